@@ -0,0 +1,69 @@
+#ifndef DIRECT_SUM_HPP
+#define DIRECT_SUM_HPP
+
+#include <vector>
+
+#include "particle_system.hpp"
+#include "gravity_kernel.hpp"
+#include "thread_pool.hpp"
+
+// Exact O(N^2) force pass that keeps the Newton's third law halving
+// (every pair is evaluated once) without threads writing the same accel.
+//
+// fast mode:          each thread owns a contiguous range of i, accumulates
+//                     into its own buffer, then the buffers are reduced.
+//                     Since row i has N - 1 - i pairs, the ranges are cut so
+//                     that every thread gets the same number of pairs
+//                     (equal index ranges are kept for comparison)
+// deterministic mode: particles are split into a fixed number of blocks and
+//                     the block pairs are run as a round-robin tournament so
+//                     that the tiles of each round touch disjoint particles.
+//                     The summation order doesn't depend on the thread count,
+//                     so the result is bit-identical for any number of threads.
+//
+// Both halved modes walk the pairs in cache-blocked tiles of tile_size
+// particles (16 bytes of x, y, mass, radius plus 8 bytes of accel each), so
+// the default 256 keeps an i tile and a j tile inside a 32 KB L1. A tile size
+// of 0 streams whole rows like the original loop.
+// vectorized mode:    every row sums over all j in single precision with the
+//                     SIMD kernel (see gravity_kernel.hpp). That gives up the
+//                     halving, but rows are independent so it needs no buffers
+//                     and is deterministic for any thread count as well.
+class DirectSum {
+
+    bool deterministic;
+    bool balanced;
+    SimdLevel simd_level; // Scalar runs the double precision halved pass
+    int num_blocks; // blocks used by the deterministic schedule, must be even
+    int tile_size;
+
+    struct AccelBuffer {
+        AlignedVector<float> ax;
+        AlignedVector<float> ay;
+    };
+    std::vector<AccelBuffer> thread_accels; // reused between frames
+    std::vector<double> thread_times; // busy time of each thread in the last pass (ms)
+
+    public:
+        DirectSum(bool deterministic = false, int num_blocks = 64);
+
+        // accelerations into particles.ax/ay, which must be zeroed first
+        void CalcAccels(ParticleSystem& particles, ThreadPool& pool);
+        // accelerations of only the particles listed in active, each summed
+        // over every other particle (no halving), written to particles.ax/ay
+        void CalcActiveAccels(ParticleSystem& particles, const std::vector<int>& active, ThreadPool& pool);
+
+        void SetDeterministic(bool deterministic);
+        bool IsDeterministic() const;
+        void SetBalanced(bool balanced);
+        bool IsBalanced() const;
+        void SetTileSize(int tile_size);
+        int GetTileSize() const;
+        void SetSimdLevel(SimdLevel simd_level);
+        SimdLevel GetSimdLevel() const;
+
+        const std::vector<double>& GetThreadTimes() const;
+        double GetImbalance() const; // slowest thread time / mean thread time
+};
+
+#endif // DIRECT_SUM_HPP
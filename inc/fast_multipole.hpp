@@ -0,0 +1,95 @@
+#ifndef FAST_MULTIPOLE_HPP
+#define FAST_MULTIPOLE_HPP
+
+#include <vector>
+
+#include "particle_system.hpp"
+#include "gravity_kernel.hpp"
+#include "quad_tree.hpp"
+#include "thread_pool.hpp"
+
+// O(N) fast multipole solver over a uniform quadtree of the particles'
+// core square (see CoreSquare), 2^depth leaves a side with about leaf_size
+// particles each. The few particles outside it are summed directly, both
+// the pull on them and theirs on everyone else.
+//
+// The force is G m d / |d|^3 (the gradient of the 1/r potential, not of 2D
+// log gravity), so the expansions are Cartesian Taylor series of 1/r in x
+// and y rather than complex Laurent series. Multipoles hold the moments
+// sum m (c - x_j)^k, locals the Taylor coefficients of sum m / |x - x_j|
+// around the cell center, both for x^a y^b with a + b <= order.
+//
+// upward:   P2M at the leaves, M2M up to the root
+// downward: M2L from the cells of each level's interaction list (children
+//           of the parent's neighbours that aren't neighbours), L2L down
+// leaves:   L2P plus the exact sum (with the close-approach cutoff) over
+//           the 3x3 neighbouring leaves, in single precision through the
+//           SIMD row kernel
+//
+// Leaves are never narrower than the cutoff length, so every pair handled
+// by the expansions is outside the cutoff anyway.
+class FastMultipole {
+
+    int order;
+    int leaf_size;
+    int num_coeffs;
+    SimdLevel simd_level; // near field kernel, detected by default
+
+    struct Level {
+        int dim; // cells a side
+        double width;
+        std::vector<int> count;         // particles in each cell
+        std::vector<double> multipoles; // num_coeffs per cell
+        std::vector<double> locals;
+        std::vector<double> m2l;        // derivatives of 1/r for the 7x7 cell offsets
+    };
+
+    // tree of the last pass
+    int depth;
+    double root_x, root_y, root_width;
+    std::vector<Level> levels;
+    std::vector<int> sorted;     // particle indices grouped by leaf, then the ones outside the root
+    int num_inside;              // sorted[num_inside, n) are outside the root
+    std::vector<int> leaf_start; // leaf c holds sorted[leaf_start[c], leaf_start[c + 1])
+    std::vector<int> leaf_of;    // leaf of every particle
+    AlignedVector<float> sorted_x, sorted_y, sorted_mass, sorted_radius;
+
+    std::vector<double> binomial; // binomial[n * (2 * order + 1) + k] = n choose k
+
+    struct M2LTerm {
+        int multipole;
+        int derivative;
+        double weight;
+    };
+    std::vector<M2LTerm> m2l_terms; // flattened M2L sum, one entry per (n, k) pair
+    std::vector<int> m2l_start;     // local coefficient c sums m2l_terms[m2l_start[c], m2l_start[c + 1])
+    AlignedVector<float> accel_x, accel_y; // all particles, for CalcActiveAccels
+
+    int Index(int a, int b) const;
+    double Binomial(int n, int k) const;
+    // Taylor coefficients D^k (1/|r|) / k! for every a + b <= order
+    void CalcDerivatives(double r_x, double r_y, double* coeffs) const;
+
+    void BuildTree(const ParticleSystem& particles, ThreadPool& pool);
+    void Upward(ThreadPool& pool);
+    void Downward(ThreadPool& pool);
+    void Evaluate(float* out_x, float* out_y, ThreadPool& pool);
+
+    public:
+        FastMultipole(int order = 6, int leaf_size = 32);
+
+        // accelerations of every particle written to particles.ax/ay
+        void CalcAccels(ParticleSystem& particles, ThreadPool& pool);
+        // same pass, but only the particles listed in active get their ax/ay written
+        void CalcActiveAccels(ParticleSystem& particles, const std::vector<int>& active, ThreadPool& pool);
+
+        void SetOrder(int order);
+        int GetOrder() const;
+        void SetLeafSize(int leaf_size);
+        int GetLeafSize() const;
+        void SetSimdLevel(SimdLevel simd_level);
+        SimdLevel GetSimdLevel() const;
+        int GetDepth() const;
+};
+
+#endif // FAST_MULTIPOLE_HPP
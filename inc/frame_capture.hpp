@@ -0,0 +1,53 @@
+#ifndef FRAME_CAPTURE_HPP
+#define FRAME_CAPTURE_HPP
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Streams the rendered frames straight into an ffmpeg process as raw RGBA
+// over a pipe, so no intermediate PNGs are compressed or written to disk.
+// Capture() copies the framebuffer into one of a ring of preallocated
+// buffers and returns, a background thread feeds the filled buffers to the
+// encoder. The render loop only waits when the whole ring is still queued.
+class FrameCapture {
+
+    int width;
+    int height;
+    std::FILE* encoder; // pipe to ffmpeg's stdin
+    bool failed;        // a write to the pipe failed
+
+    std::vector<std::vector<unsigned char>> ring;
+    std::deque<int> free_slots;
+    std::deque<int> filled_slots;
+    bool finishing;
+
+    std::mutex mutex;
+    std::condition_variable slot_freed;
+    std::condition_variable slot_filled;
+    std::thread writer;
+
+    void WriterLoop();
+
+    public:
+        FrameCapture(int width, int height, int fps, const std::string& output, int ring_size = 8);
+        ~FrameCapture();
+
+        FrameCapture(const FrameCapture&) = delete;
+        FrameCapture& operator=(const FrameCapture&) = delete;
+
+        bool IsOpen() const;
+
+        // grabs the current framebuffer (flushes raylib's batch first)
+        void Capture();
+
+        // waits for the queued frames, closes the pipe and returns whether
+        // the video was written successfully
+        bool Finish();
+};
+
+#endif // FRAME_CAPTURE_HPP
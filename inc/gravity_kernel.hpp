@@ -0,0 +1,34 @@
+#ifndef GRAVITY_KERNEL_HPP
+#define GRAVITY_KERNEL_HPP
+
+#include "particle_system.hpp"
+
+// instruction sets the vectorized all-pairs kernel can run on
+enum class SimdLevel {
+    Scalar,
+    SSE2,   // 4 float lanes
+    AVX2,   // 8 float lanes (with FMA)
+    AVX512  // 16 float lanes
+};
+
+// best level supported by the CPU we are running on
+SimdLevel DetectSimdLevel();
+const char* SimdLevelName(SimdLevel level);
+
+// Full (not halved) single precision sum over every particle j for each i in
+// [start, end), written to accel_x/accel_y[i]. Each i only
+// writes its own entry, so ranges can run on different threads, and the
+// summation order doesn't depend on how [start, end) is split.
+// 1/r uses the hardware reciprocal square root plus one Newton step, the
+// close-approach cutoff is applied as a lane mask.
+void CalcAccelsSimd(const ParticleSystem& particles, float* accel_x, float* accel_y, int start, int end, SimdLevel level);
+// same for the particles indices[start, end) instead of a contiguous range
+void CalcAccelsSimd(const ParticleSystem& particles, float* accel_x, float* accel_y, const int* indices, int start, int end, SimdLevel level);
+
+// adds sum mass_j d / |d|^3 (d = (x_j - x_i, y_j - y_i), without G) over
+// j in [start, end) of plain, unaligned arrays to sum_x/sum_y, with the
+// same cutoff (which also skips the point itself)
+void SumRowSimd(const float* x, const float* y, const float* mass, const float* radius, int start, int end, 
+    float x_i, float y_i, float radius_i, float& sum_x, float& sum_y, SimdLevel level);
+
+#endif // GRAVITY_KERNEL_HPP
@@ -4,17 +4,19 @@
 #include <cmath>
 #include <raylib-cpp.hpp>
 
+#include "particle_system.hpp"
+
+// colour changes with speed, purple for positive masses and green for negative ones
+raylib::Color ParticleColour(double vel_x, double vel_y, double mass);
+
+// Read-only view of one particle of a ParticleSystem for the renderer
 struct Particle {
-    Particle(raylib::Vector2 pos);
-    Particle(int pos_x, int pos_y);
+    Particle(const ParticleSystem& particles, std::size_t index);
 
-    void CalcAccel(Particle& extern_particle, double dt);
-    void Update(double dt);
     void Draw() const;
 
     raylib::Vector2 pos;
     raylib::Vector2 vel;
-    raylib::Vector2 accel;
     double size;
     double mass;
     raylib::Color colour;
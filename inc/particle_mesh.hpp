@@ -0,0 +1,88 @@
+#ifndef PARTICLE_MESH_HPP
+#define PARTICLE_MESH_HPP
+
+#include <complex>
+#include <vector>
+
+#include "particle_system.hpp"
+#include "gravity_kernel.hpp"
+#include "quad_tree.hpp"
+#include "thread_pool.hpp"
+
+// Particle-mesh solver, O(N + M^2 log M) for an M x M grid:
+//
+// 1. cloud-in-cell deposit of the masses onto the grid nodes, every thread
+//    into its own grid, then reduced
+// 2. the acceleration field is the convolution of the mass grid with the
+//    pair force G d / |d|^3 sampled at the node offsets, done with FFTs
+//    (the kernel transforms are cached until the grid size or the cutoff in
+//    cells changes, and scaled by 1 / cell width^2)
+// 3. cloud-in-cell interpolation of the field back to the particles
+//
+// The force is the planar 1/r^2 law the other solvers use rather than the
+// solution of a 2D Poisson equation (which would be 1/r), hence the
+// convolution with the force kernel instead of dividing by k^2.
+//
+// Isolated: the grid covers the particles' core square (see CoreSquare) and
+// is zero padded to 2M x 2M so the FFT's wrap-around doesn't alias. The few
+// particles outside it are summed directly, both the pull on them and
+// theirs on everyone on the grid.
+// Periodic: the grid covers the fixed box and forces come from the nearest
+// image of every cell (the kernel is wrapped at M / 2).
+//
+// The kernel is zero inside the close-approach cutoff (taken for the
+// largest particle), and forces below a couple of cell widths are smoothed
+// out by the cloud-in-cell assignment.
+class ParticleMesh {
+
+    int grid_size;
+    bool periodic;
+    Quad box; // periodic box
+    SimdLevel simd_level; // direct sums of the particles off the grid
+
+    // grid of the last pass, node (i, j) sits at origin + (i, j) * cell_width
+    int fft_size; // 2 * grid_size isolated, grid_size periodic
+    double origin_x, origin_y, cell_width;
+    double cutoff_cells; // close-approach cutoff length in cells
+    Quad root; // isolated: the particles outside it are off the grid
+    std::vector<int> outside; // those particles, in index order
+    AlignedVector<float> outside_x, outside_y, outside_mass, outside_radius;
+    std::vector<std::vector<int>> thread_outside;
+
+    // transforms of the unit force kernel -e / |e|^3, rebuilt when the grid or cutoff changes
+    int kernel_size;
+    bool kernel_periodic;
+    double kernel_cutoff;
+    std::vector<std::complex<double>> kernel_x, kernel_y;
+
+    std::vector<std::complex<double>> density, field_x, field_y; // fft_size^2
+    std::vector<std::vector<double>> thread_masses; // grid_size^2 deposit grid per thread
+    AlignedVector<float> accel_x, accel_y; // all particles, for CalcActiveAccels
+
+    bool IsOutside(const ParticleSystem& particles, int i) const;
+    // cloud-in-cell nodes and weights of particle i, shared by the deposit and
+    // the interpolation so a particle doesn't push itself
+    void Cloud(const ParticleSystem& particles, int i, int& cell_x, int& cell_y, int& next_x, int& next_y, double& f_x, double& f_y) const;
+    void BuildKernel(ThreadPool& pool);
+    void Deposit(const ParticleSystem& particles, ThreadPool& pool);
+    void Solve(ThreadPool& pool);
+    void Interpolate(const ParticleSystem& particles, float* out_x, float* out_y, ThreadPool& pool);
+
+    public:
+        ParticleMesh(int grid_size = 256);
+
+        // accelerations of every particle written to particles.ax/ay
+        void CalcAccels(ParticleSystem& particles, ThreadPool& pool);
+        // same pass, but only the particles listed in active get their ax/ay written
+        void CalcActiveAccels(ParticleSystem& particles, const std::vector<int>& active, ThreadPool& pool);
+
+        // rounded up to a power of two
+        void SetGridSize(int grid_size);
+        int GetGridSize() const;
+        // forces of a periodic box instead of an isolated system; particles
+        // are expected to be wrapped into the box (see Simulation::SetPeriodic)
+        void SetPeriodic(bool periodic, const Quad& box);
+        bool IsPeriodic() const;
+};
+
+#endif // PARTICLE_MESH_HPP
@@ -0,0 +1,101 @@
+#ifndef PARTICLE_RENDERER_HPP
+#define PARTICLE_RENDERER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <raylib-cpp.hpp>
+
+#include "particle_system.hpp"
+#include "quad_tree.hpp"
+#include "thread_pool.hpp"
+
+// Draws every particle as a circle outline in one instanced draw call.
+// Each frame the positions, radii and colours are packed into a single
+// vertex buffer (16 bytes a particle) and uploaded once; a unit quad is
+// instanced over it and the fragment shader cuts the one pixel ring out of
+// the quad, so the cost no longer depends on how many line segments
+// DrawCircleLines would have generated.
+//
+// Needs an OpenGL 3.3 context (instancing and GLSL 330). Without one, or if
+// the shader fails to compile, it falls back to Particle::Draw() for every
+// particle, which can also be selected with SetInstanced(false).
+//
+// Level of detail: once a particle is smaller than lod_pixel_size on
+// screen, circles stop being readable and thousands of them land on the
+// same pixel. The particles are then binned into a screen-space grid of
+// lod_cell_size pixel cells instead (every thread of the renderer's own
+// pool into its own grid, then summed), tone mapped with log(1 + count)
+// and drawn as one texture covering the view.
+//
+// Culling: given a quad tree of the particles, only the ones it finds
+// inside the camera rectangle are packed and drawn, so zoomed-in frames
+// cost what's visible rather than N.
+class ParticleRenderer {
+
+    struct Instance {
+        float x, y, radius;
+        unsigned char colour[4];
+    };
+
+    bool supported; // instancing available in this context
+    bool instanced;
+
+    Shader shader;
+    int mvp_loc;
+    unsigned int vao;
+    unsigned int corner_vbo;   // the 6 corners of the unit quad
+    unsigned int instance_vbo; // one Instance per particle
+    std::size_t capacity;      // instances instance_vbo has room for
+    std::vector<Instance> instances;
+    std::vector<int> visible; // culled particle indices
+    std::size_t drawn_count;
+
+    // density splat
+    bool density_lod;
+    bool density_active; // the last Draw() used it
+    float lod_pixel_size;
+    int lod_cell_size;
+    ThreadPool pool;
+    std::vector<std::vector<std::uint32_t>> thread_counts; // per thread grid
+    std::vector<std::uint32_t> counts;
+    std::vector<Color> pixels;
+    Texture2D density_texture;
+
+    // every particle, or only the listed ones
+    void DrawInstanced(const ParticleSystem& particles, const std::vector<int>* subset);
+    // largest on-screen diameter in pixels
+    float MaxPixelSize(const ParticleSystem& particles, float zoom);
+    void DrawDensity(const ParticleSystem& particles, const Camera2D& cam);
+
+    public:
+        // needs the window (GL context) to exist already, num_threads only bins the density splat
+        ParticleRenderer(int num_threads = std::max(1u, std::thread::hardware_concurrency() / 2));
+        ~ParticleRenderer();
+
+        ParticleRenderer(const ParticleRenderer&) = delete;
+        ParticleRenderer& operator=(const ParticleRenderer&) = delete;
+
+        // call between BeginMode2D/EndMode2D with that camera, like Particle::Draw().
+        // With a tree over particles, anything off screen is skipped
+        void Draw(const ParticleSystem& particles, const Camera2D& cam, const QuadTree* tree = nullptr);
+
+        bool IsSupported() const;
+        // ignored when instancing isn't supported
+        void SetInstanced(bool instanced);
+        bool IsInstanced() const;
+
+        void SetDensityLod(bool density_lod);
+        bool IsDensityLod() const;
+        bool IsDensityActive() const;
+        // particles drawn as circles by the last Draw()
+        std::size_t GetDrawnCount() const;
+        // on-screen diameter below which the density splat takes over
+        void SetLodPixelSize(float lod_pixel_size);
+        float GetLodPixelSize() const;
+        void SetLodCellSize(int lod_cell_size);
+        int GetLodCellSize() const;
+};
+
+#endif // PARTICLE_RENDERER_HPP
@@ -0,0 +1,74 @@
+#ifndef PARTICLE_SYSTEM_HPP
+#define PARTICLE_SYSTEM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// allocator for std::vector that hands out cache line (and AVX-512) aligned storage
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* p, std::size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// Structure-of-Arrays particle storage, one contiguous aligned array per
+// component so the force kernels only stream the fields they read
+// (x, y, mass and radius) and can be vectorized.
+class ParticleSystem {
+
+    public:
+        AlignedVector<float> x;
+        AlignedVector<float> y;
+        AlignedVector<float> vx;
+        AlignedVector<float> vy;
+        AlignedVector<float> ax;
+        AlignedVector<float> ay;
+        AlignedVector<float> mass;
+        AlignedVector<float> radius;
+        AlignedVector<std::int8_t> level; // block timestep level, the particle steps by dt / 2^level
+        AlignedVector<std::uint32_t> id;  // stable through reorders, never reused
+        std::uint32_t next_id = 0;        // id the next Add() hands out
+
+        void Add(float pos_x, float pos_y, float vel_x = 0.0f, float vel_y = 0.0f, float mass = 1000.0f, float radius = 1.0f);
+        void Clear();
+        void Reserve(std::size_t n);
+        // every array to n particles, for Gather() to fill
+        void Resize(std::size_t n);
+        // particle k = source particle order[k] for k in [start, end), after Resize()
+        void Gather(const ParticleSystem& source, const int* order, std::size_t start, std::size_t end);
+
+        void ResetAccels(std::size_t start, std::size_t end);
+        // v += a * dt over [start, end)
+        void Kick(double dt, std::size_t start, std::size_t end);
+        // x += v * dt over [start, end)
+        void Drift(double dt, std::size_t start, std::size_t end);
+
+        std::size_t Size() const;
+};
+
+#endif // PARTICLE_SYSTEM_HPP
@@ -1,25 +1,30 @@
 #ifndef QUADTREE_HPP
 #define QUADTREE_HPP
 
+#include <cstdint>
+#include <utility>
 #include <vector>
 #include <memory>
 
 #include <raylib-cpp.hpp>
 
+#include "particle_system.hpp"
+#include "thread_pool.hpp"
+
 struct Point {
 
-    int x, y;
+    float x, y;
 
-    Point(int x, int y) : 
+    Point(float x, float y) : 
         x(x), 
         y(y) {}
 
 };
 
 struct Quad {
-    int x, y, width, height;
+    float x, y, width, height;
 
-    Quad(int x, int y, int width, int height) : 
+    Quad(float x, float y, float width, float height) : 
         x(x), 
         y(y), 
         width(width), 
@@ -34,31 +39,205 @@ struct Quad {
             point.y <= y + height);
     }
 
+    bool Contains(const Quad& other) const {
+        return (
+            other.x >= x &&
+            other.x + other.width <= x + width &&
+            other.y >= y &&
+            other.y + other.height <= y + height);
+    }
+
+    bool Intersects(const Quad& other) const {
+        return (
+            other.x <= x + width &&
+            other.x + other.width >= x &&
+            other.y <= y + height &&
+            other.y + other.height >= y);
+    }
+
 };
 
+// world space rectangle the camera shows on screen
+Quad CameraBounds(const Camera2D& cam);
+
+// smallest square (at least 1 wide) from the lowest x and y of the
+// particles, padded a little so the largest coordinates still fall inside
+Quad BoundingSquare(const ParticleSystem& particles);
+// the same from one min/max reduction per pool thread
+Quad BoundingSquare(const ParticleSystem& particles, ThreadPool& pool);
+// the same over the particles inside box, num_outside gets how many are not
+Quad BoundingSquare(const ParticleSystem& particles, const Quad& box, int& num_outside, ThreadPool& pool);
+// particles CoreSquare() may leave outside, each one costs the solvers a
+// direct sum over all the others
+const int MAX_OUTSIDE = 32;
+
+// Root for a tree or grid over the particles: their bounding square, unless
+// a few of them (at most max_outside) are far enough out to more than double
+// it. Then it is the bounding square of the rest and the few are left
+// outside, for the solver to sum directly, so one ejected particle doesn't
+// stretch the root and cost the rest their resolution
+Quad CoreSquare(const ParticleSystem& particles, ThreadPool& pool, int max_outside = MAX_OUTSIDE);
+
+// Quad tree over a ParticleSystem. Positions are placed on a fixed-point
+// grid of 2^max_depth cells a side over the boundary, and every split
+// halves a node along the grid, so all the ways of placing a particle
+// (both builds and Update()) agree exactly.
+// No node goes deeper than max_depth: a leaf splits once it holds more
+// than capacity particles, except at max_depth, where it keeps any number
+// (however many particles pile up on one spot).
+//
+// The nodes live in one flat pool and refer to each other by index (the
+// four children of a node are consecutive, so a node only stores the first
+// one), and the particles are never stored per node: Build() partitions one
+// index array top-down, so every node, leaf or not, covers a contiguous
+// range of it.
+// Clearing keeps the pool's and the array's capacity, so rebuilding
+// doesn't allocate once the tree has reached its size.
+//
+// Build() with a thread pool is the linear variant: every particle gets a
+// Morton key (its quadrant path down the tree, two bits a level) in
+// parallel, the keys are sorted with a parallel LSD radix sort, and the
+// nodes are read off the sorted keys, where each child is a run of equal
+// digits. The top few levels are split on the calling thread, then the
+// subtrees below them (at least four a thread) are built concurrently, each
+// into its own node pool, and copied into the shared one behind the top
+// levels. Both builds give the same tree, only the node numbering differs.
+//
+// Update() keeps the tree of the last step instead: only the particles that
+// left their leaf are relocated (the rest keep their place in the index
+// array), leaves that overflow split, nodes that fall to capacity merge,
+// and the aggregates are recomputed (the children blocks freed by merges
+// are reused by later splits). Too many movers and a full Build() is
+// cheaper, so it falls back to one.
 class QuadTree {
 
+    struct Node {
+        Quad boundary;
+        int first_child; // children are first_child .. first_child + 3 (nw, ne, sw, se), -1 for a leaf
+        int start;       // the node's particles are order[start, start + count)
+        int count;
+
+        // Barnes-Hut aggregates over every particle in the node
+        double mass;      // signed total mass
+        double abs_mass;  // total of |mass|, used to weight the center of mass
+        double com_x;     // center of mass (weighted by |mass|)
+        double com_y;
+        double max_size;  // largest particle size, used for the close-approach cutoff
+    };
+
+    int capacity;  // maximum particles in a leaf before subdividing
+    int max_depth; // levels below the root, the leaves there keep everything
     Quad boundary;
-    int capacity; // maximum capacity before subdividing
-    std::vector<Point> points;
-    bool divided;
-    bool is_master;
-
-    std::unique_ptr<QuadTree> ne; // northeast
-    std::unique_ptr<QuadTree> nw; 
-    std::unique_ptr<QuadTree> se; 
-    std::unique_ptr<QuadTree> sw; 
+    double cell_scale_x; // grid cells per unit
+    double cell_scale_y;
+    const ParticleSystem* particles; // particles the indices refer to
+    std::size_t num_particles;       // particles.Size() at the last build
+    std::vector<Node> nodes; // nodes[0] is the root
+    std::vector<int> order;  // particle indices grouped by node
+    std::vector<int> scratch; // partition buffer
+
+    // linear build
+    int key_levels; // levels of quadrant digits in a key (max_depth), 0 when order isn't sorted by key
+    std::vector<std::uint64_t> keys; // Morton key of every order entry
+    std::vector<std::uint64_t> key_scratch;
+    std::vector<int> thread_counts; // per thread inside counts, then per thread digit histograms
+
+    // parallel build
+    struct Subtree {
+        int node;  // its root in nodes
+        int level;
+        int first; // where the rest of its nodes go in nodes
+    };
+    std::vector<Subtree> subtrees; // below the top levels, built on their own
+    std::vector<std::vector<Node>> subtree_nodes; // every subtree's nodes, its root first
+
+    // incremental update
+    std::vector<int> outside; // particles left out, summed directly, they may come back in
+    std::vector<int> leaves;  // leaf nodes in tree order
+    std::vector<std::pair<std::uint64_t, int>> leaf_paths; // (quadrant digits from the root, level) of every leaf
+    std::vector<int> leaf_positions; // position in leaves of every leaf node
+    std::vector<std::pair<int, int>> arrivals; // (position in leaves, particle) of every mover
+    std::vector<int> free_blocks; // first nodes of child blocks freed by merges, reused by splits
+    int moved_count;
+    bool rebuilt;
+
+    // grid cell of a position, the edges clamped into the grid
+    std::uint32_t CellX(float x) const;
+    std::uint32_t CellY(float y) const;
+    // every quadrant digit of the position down to max_depth, the top level's highest
+    std::uint64_t MortonKey(float x, float y) const;
+    // quadrant (nw, ne, sw, se) particle j falls in below a node at level
+    int Quadrant(int j, int level) const;
+    void RadixSort(ThreadPool& pool);
+    // the node's range split into its quadrants (nw, ne, sw, se)
+    void Partition(const Node& node, int level, int child_start[4], int counts[4]);
+    // the four children over those ranges, returns the first
+    int AddChildren(std::vector<Node>& tree_nodes, int node_index, const int child_start[4], const int counts[4]);
+    bool IsLeaf(const Node& node, int level) const;
+    // builds the subtree below the node, in tree_nodes (nodes or a subtree's own pool)
+    void Subdivide(std::vector<Node>& tree_nodes, int node_index, int level);
+    // the levels above subtree_level, every node there becomes a subtree
+    void SplitTop(int node_index, int level, int subtree_level);
+    // aggregates of those levels once the subtrees have theirs
+    void CombineTop(int node_index, int level, int subtree_level);
+    void LeafAggregates(Node& node) const;
+    void CombineChildren(std::vector<Node>& tree_nodes, int node_index);
+    // leaf whose quad the point falls into, the way Subdivide() splits
+    int Locate(float x, float y) const;
+    void CollectLeaves(int node_index, int level, std::uint64_t path);
+    void Refit(int node_index, int level);
+    // first of four consecutive free nodes
+    int AllocateChildren(std::vector<Node>& tree_nodes);
+    // the block and every block below it
+    void FreeChildren(int first_child);
+    void AccumulateAccel(int node_index, int index, double theta, double& accel_x, double& accel_y) const;
+    void Query(int node_index, const Quad& range, std::vector<int>& found) const;
+    void Draw(int node_index, raylib::Camera2D cam, const Quad& view) const;
 
     public:
-        QuadTree(const Quad &quad, int capacity);
-        QuadTree(const Quad &quad, int capacity, bool is_master);
-
-        void Subdivide();
-        bool Insert(const Point &point);
-        // TODO Traverse function
-        void Draw(raylib::Camera2D cam) const;
-
+        // max_depth is at most 30
+        QuadTree(int capacity = 2, int max_depth = 16);
+
+        // every particle inside boundary, the rest are left out of the
+        // nodes and only interact through the direct sum in CalcAccel()
+        void Build(const Quad& boundary, const ParticleSystem& particles);
+        // the same tree from sorted Morton keys, keys, sort and subtrees on the pool's threads
+        void Build(const Quad& boundary, const ParticleSystem& particles, ThreadPool& pool);
+        // empty tree, the storage is kept
+        void Clear();
+
+        // The tree of the last Build() moved along with the particles. Builds
+        // from scratch instead when the boundary or the particle count changed
+        // or more than max_moved of the particles left their leaf; anything
+        // else that renumbers particles (reorders) needs an explicit Build()
+        void Update(const Quad& boundary, const ParticleSystem& particles, ThreadPool& pool, double max_moved);
+        // particles that changed leaf (or entered/left the tree) in the last Update()
+        int GetMovedCount() const;
+        // the last Build() or Update() built the tree from scratch
+        bool WasRebuilt() const;
+
+        // Barnes-Hut traversal: acceleration on particle index (same units as
+        // the direct sum). A node is treated as a single body when
+        // width / distance < theta, so theta = 0 degenerates to the exact sum.
+        // Particles outside the boundary are summed directly, in both directions
+        void CalcAccel(int index, double theta, float& accel_x, float& accel_y) const;
+
+        // indices of the particles inside range, subtrees entirely inside it
+        // are gathered without testing their particles
+        void Query(const Quad& range, std::vector<int>& found) const;
+
+        // only the nodes intersecting view, and none below a pixel
+        void Draw(raylib::Camera2D cam, const Quad& view) const;
+
+        bool IsEmpty() const;
         const Quad& GetBoundary() const;
+        double GetMaxSize() const;
+        // nodes in use
+        int GetNodeCount() const;
+        // particles left outside the boundary
+        int GetOutsideCount() const;
+        int GetCapacity() const;
+        int GetMaxDepth() const;
 };
 
 #endif // QUADTREE_HPP
@@ -0,0 +1,188 @@
+#ifndef SIMULATION_HPP
+#define SIMULATION_HPP
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "particle_system.hpp"
+#include "quad_tree.hpp"
+#include "direct_sum.hpp"
+#include "fast_multipole.hpp"
+#include "particle_mesh.hpp"
+#include "thread_pool.hpp"
+
+enum class ForceSolver {
+    Exact,        // all pairs, O(N^2)
+    BarnesHut,    // quad tree approximation, O(N log N)
+    FastMultipole, // multipole and local expansions, O(N)
+    ParticleMesh   // FFT convolution on a grid, O(N + M^2 log M)
+};
+
+const char* ForceSolverName(ForceSolver solver);
+
+enum class Integrator {
+    Euler,         // semi-implicit Euler, first order (the original scheme)
+    Leapfrog,      // kick-drift-kick leapfrog, second order and symplectic
+    VelocityVerlet // velocity Verlet, same trajectory as leapfrog in position form
+};
+
+const char* IntegratorName(Integrator integrator);
+
+struct SimulationStats {
+    long long step;
+    double time;
+    std::size_t num_particles;
+    double total_mass;
+    double kinetic_energy;
+    double momentum_x;
+    double momentum_y;
+    double step_ms; // wall time of the last Step()
+    long long force_evals; // particle accelerations computed by the last Step()
+    int tree_moved;    // Barnes-Hut: particles that changed leaf in the last tree update
+    bool tree_rebuilt; // Barnes-Hut: the last tree was built from scratch
+    double disorder;      // levels the particle order decayed by at the last reorder check
+    int reorder_interval; // steps between reorder checks
+    bool reordered;       // the last Step() sorted the particles
+};
+
+// The physics loop on its own: tree build, force pass and integration.
+// Needs no window or GPU context, so it can be stepped headless or driven
+// by the interactive renderer in main.cpp.
+class Simulation {
+
+    ParticleSystem particles;
+    ThreadPool pool;
+    DirectSum direct_sum;
+    FastMultipole fast_multipole;
+    ParticleMesh particle_mesh;
+    QuadTree quad_tree; // built by the last Step()
+
+    Quad boundary;    // periodic box, particles are wrapped around it when periodic
+    Quad tree_bounds; // Barnes-Hut root, follows the particles
+    bool periodic;
+    ForceSolver solver;
+    double theta; // Barnes-Hut opening angle
+    double tree_rebuild_fraction; // particles changing leaf above which the tree is rebuilt instead of updated
+    bool particles_renumbered;    // reorders since the last tree, Update() can't follow those
+    Integrator integrator;
+    double dt;
+
+    // particles.ax/ay hold a(x) of the current positions for the first
+    // accel_count particles, so leapfrog and Verlet can reuse the closing
+    // force pass of one step to open the next
+    std::size_t accel_count;
+    AlignedVector<float> prev_ax; // velocity Verlet: a(x) at the start of the step
+    AlignedVector<float> prev_ay;
+
+    // block timesteps: with max_level > 0 each Step() is split into
+    // 2^max_level substeps and particle i steps by dt / 2^level[i], picked
+    // as eta * sqrt(cutoff length / |a|) rounded down to a power of two.
+    // Only particles finishing their step on a substep get new forces
+    int max_level;
+    double eta;
+    std::vector<int> active; // particles whose forces are due, reused between substeps
+    long long force_evals;
+
+    // spatial reordering: every reorder_interval steps each particle gets a
+    // Morton key over their core square (see CoreSquare), and the tree level
+    // at which the keys of neighbours in memory part (about log2 of their
+    // distance) is averaged. Once that has grown by a level (reorder_disorder)
+    // past its value right after the last sort, the particle arrays are
+    // sorted by key, so particles close in space are close in memory again.
+    // Adaptive, the interval halves when the order decayed by more than two
+    // levels in between and doubles when it decayed by less than half of one
+    int reorder_interval; // 0 never reorders
+    bool adaptive_reorder;
+    int steps_since_reorder;
+    double disorder;      // levels the average split height rose since the last sort
+    double sorted_height; // average split height right after the last sort, plus log2 of the box width
+    bool reordered;
+    std::vector<std::uint64_t> reorder_keys; // key << 32 | index
+    std::vector<int> reorder_order;
+    ParticleSystem reorder_buffer;
+
+    long long step_count;
+    double step_ms;
+    std::mt19937 gen;
+
+    void BuildTree();
+    // sorts the particles by Morton key when due, see reorder_interval
+    void Reorder();
+    // sorts the particles by reorder_keys, computed over box
+    void SortByKeys(const Quad& box);
+    // average level at which neighbours in memory part, over reorder_keys
+    double SplitHeight();
+    // rebuilds the tree if needed and writes a(x) into particles.ax/ay
+    void CalcAccels();
+    // same for only the particles in active
+    void CalcActiveAccels();
+    // kick-drift-kick leapfrog over 2^max_level substeps, see max_level
+    void BlockStep();
+    int PickLevel(int index, int substep) const;
+
+    public:
+        Simulation(const Quad &boundary, double dt, int num_threads = std::thread::hardware_concurrency(), unsigned seed = std::random_device()());
+
+        // square_dim x square_dim grid of particles every spacing units around
+        // the center, with random velocities plus a spiral around the center
+        void SpawnSpiral(float center_x, float center_y, int square_dim, int spacing);
+
+        void Step();
+        void Clear();
+        // particles sorted by Morton key now, ids stay with their particles
+        void SortParticles();
+
+        // total gravitational potential energy, O(N^2) so only for diagnostics
+        double CalcPotentialEnergy();
+
+        // writes one "id,x,y,vx,vy,mass" line per particle
+        bool WriteSnapshot(const std::string& path) const;
+
+        ParticleSystem& GetParticles();
+        const ParticleSystem& GetParticles() const;
+        DirectSum& GetDirectSum();
+        FastMultipole& GetFastMultipole();
+        ParticleMesh& GetParticleMesh();
+        const QuadTree* GetQuadTree() const;
+        const Quad& GetBoundary() const;
+        // root of the last Barnes-Hut tree
+        const Quad& GetTreeBounds() const;
+        SimulationStats GetStats() const;
+
+        void SetSolver(ForceSolver solver);
+        ForceSolver GetSolver() const;
+        void SetTheta(double theta);
+        double GetTheta() const;
+        // particles a Barnes-Hut leaf holds before it splits, and the levels
+        // below which it never does. Both start the tree over
+        void SetTreeLeafSize(int leaf_size);
+        int GetTreeLeafSize() const;
+        void SetTreeMaxDepth(int max_depth);
+        int GetTreeMaxDepth() const;
+        // 0 rebuilds the Barnes-Hut tree every time, 1 only updates it
+        void SetTreeRebuildFraction(double tree_rebuild_fraction);
+        double GetTreeRebuildFraction() const;
+        // steps between reorder checks, the starting value when adaptive
+        void SetReorderInterval(int reorder_interval);
+        int GetReorderInterval() const;
+        void SetAdaptiveReorder(bool adaptive_reorder);
+        bool IsAdaptiveReorder() const;
+        void SetIntegrator(Integrator integrator);
+        Integrator GetIntegrator() const;
+        // 0 steps everything with the global dt and integrator
+        void SetBlockLevels(int max_level);
+        int GetBlockLevels() const;
+        void SetTimestepAccuracy(double eta);
+        double GetTimestepAccuracy() const;
+        double GetDt() const;
+        // wrap positions around the boundary instead of letting particles
+        // leave it. Only the particle-mesh solver sees the periodic images,
+        // the others still treat the box as isolated
+        void SetPeriodic(bool periodic);
+        bool IsPeriodic() const;
+};
+
+#endif // SIMULATION_HPP
@@ -0,0 +1,108 @@
+#ifndef SIMULATION_THREAD_HPP
+#define SIMULATION_THREAD_HPP
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "simulation.hpp"
+#include "gravity_kernel.hpp"
+#include "spsc_queue.hpp"
+
+// what the render thread gets to see of the simulation after a step
+struct Snapshot {
+    long long sequence; // bumped for every published snapshot
+    ParticleSystem particles;
+    QuadTree tree{8}; // over particles, for culling, only built on request
+    bool has_tree;
+    SimulationStats stats;
+
+    ForceSolver solver;
+    double theta;
+    Integrator integrator;
+    double dt;
+    int block_levels;
+    bool periodic;
+    int fmm_order;
+    int fmm_depth;
+    int grid_size;
+    SimdLevel simd_level;
+    bool deterministic;
+    bool balanced;
+    double imbalance;
+    std::vector<double> thread_times;
+};
+
+// runs on the simulation thread between steps
+using SimulationCommand = std::function<void(Simulation&)>;
+
+// Steps a Simulation on its own thread so a slow force pass doesn't stall
+// input or drawing.
+//
+// After every step the thread copies the state into the back buffer of a
+// triple buffer and swaps it with the middle slot. Acquire() swaps the
+// front buffer with the middle slot when that holds a newer snapshot, so
+// neither side ever waits for the other and a snapshot stays untouched
+// while it is drawn.
+//
+// Everything that changes the simulation (spawns, clears, settings) is
+// posted as a command through a lock-free single producer queue and run
+// before the next step. Only the thread that calls Start() may post and
+// acquire.
+//
+// Paced (the default), the simulation doesn't step again until the last
+// snapshot has been acquired, one step per drawn frame like the old single
+// threaded loop; unpaced it runs as fast as it can.
+//
+// With SetPublishTree(true) every snapshot also carries a quad tree of its
+// particles, so the renderer can look up what's on screen without
+// touching the rest.
+class SimulationThread {
+
+    static constexpr int fresh_bit = 4; // middle holds a snapshot Acquire() hasn't seen
+
+    Simulation& sim;
+    SpscQueue<SimulationCommand> commands;
+
+    Snapshot buffers[3];
+    int back;                // simulation thread only
+    int front;               // render thread only
+    std::atomic<int> middle; // buffer index | fresh_bit
+    long long sequence;
+
+    std::atomic<long long> consumed; // sequence of the last acquired snapshot
+    std::atomic<bool> paced;
+    std::atomic<bool> publish_tree;
+    std::atomic<bool> running;
+    std::thread thread;
+
+    void Loop();
+    void Publish();
+
+    public:
+        // sim has to outlive the thread
+        SimulationThread(Simulation& sim, std::size_t queue_size = 1024);
+        ~SimulationThread();
+
+        SimulationThread(const SimulationThread&) = delete;
+        SimulationThread& operator=(const SimulationThread&) = delete;
+
+        // publishes the current state, so Acquire() has something to return, then starts stepping
+        void Start();
+        // finishes the current step and joins, commands still queued are dropped
+        void Stop();
+
+        // false when the queue is full, the command is dropped
+        bool Post(SimulationCommand command);
+
+        // newest published snapshot, valid until the next Acquire()
+        const Snapshot& Acquire();
+
+        void SetPaced(bool paced);
+        bool IsPaced() const;
+        void SetPublishTree(bool publish_tree);
+        bool IsPublishTree() const;
+};
+
+#endif // SIMULATION_THREAD_HPP
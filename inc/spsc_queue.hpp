@@ -0,0 +1,60 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// head and tail only ever grow and are masked into a power-of-two ring; each
+// is written by one side only, so a release store after touching a slot and
+// an acquire load before reading it are all the synchronization needed.
+template <typename T>
+class SpscQueue {
+
+    std::vector<T> slots;
+    std::size_t mask;
+
+    alignas(64) std::atomic<std::size_t> head; // next slot to pop, written by the consumer
+    alignas(64) std::atomic<std::size_t> tail; // next slot to push, written by the producer
+
+    public:
+        // capacity is rounded up to a power of two
+        explicit SpscQueue(std::size_t capacity) : head(0), tail(0) {
+            std::size_t size = 1;
+            while (size < capacity) {
+                size *= 2;
+            }
+            slots.resize(size);
+            mask = size - 1;
+        }
+
+        SpscQueue(const SpscQueue&) = delete;
+        SpscQueue& operator=(const SpscQueue&) = delete;
+
+        // producer only, false (and value untouched) when the queue is full
+        bool Push(T&& value) {
+            std::size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == slots.size()) {
+                return false;
+            }
+            slots[t & mask] = std::move(value);
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // consumer only, false when the queue is empty
+        bool Pop(T& value) {
+            std::size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+            value = std::move(slots[h & mask]);
+            slots[h & mask] = T(); // release whatever the slot held right away
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+};
+
+#endif // SPSC_QUEUE_HPP
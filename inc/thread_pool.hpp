@@ -0,0 +1,52 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <barrier>
+#include <functional>
+
+// Persistent worker threads that live for the whole run. Run() hands the
+// same task to every thread (the calling thread takes part as thread 0) and
+// only returns once all of them are done, so consecutive Run() calls act as
+// phases separated by a barrier. Tasks that need more than one phase
+// internally can call Sync() to wait for the other threads.
+class ThreadPool {
+
+    int num_threads;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    const std::function<void(int, int)>* task;
+    long long generation; // bumped for every Run()
+    int remaining;        // workers still busy with the current task
+    bool stopping;
+
+    std::barrier<> sync;
+
+    void WorkerLoop(int thread_id);
+
+    public:
+        ThreadPool(int num_threads = std::thread::hardware_concurrency());
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        // task(thread_id, num_threads) on every thread, blocks until all finish
+        void Run(const std::function<void(int, int)>& task);
+
+        // task(start, end) over [begin, end) split into one contiguous range per thread
+        void ParallelFor(int begin, int end, const std::function<void(int, int)>& task);
+
+        // barrier between the threads of the current Run() task
+        void Sync();
+
+        int GetNumThreads() const;
+};
+
+#endif // THREAD_POOL_HPP
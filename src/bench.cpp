@@ -0,0 +1,692 @@
+#include <iostream>
+#include <cmath>
+#include <random>
+#include <format>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <functional>
+#include <vector>
+
+#include "particle_system.hpp"
+#include "direct_sum.hpp"
+#include "gravity_kernel.hpp"
+#include "thread_pool.hpp"
+#include "simulation.hpp"
+#include "fast_multipole.hpp"
+#include "particle_mesh.hpp"
+#include "quad_tree.hpp"
+
+// Force solver benchmarks, `make bench` runs all of them.
+// Pass section names (e.g. `bin/bench tiling`) to run only some.
+
+// uniform disk around the origin with the same spiral velocity field as the default scene
+static ParticleSystem SpiralDisk(int n, double radius, unsigned seed) {
+
+    ParticleSystem particles;
+    particles.Reserve(n);
+
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (int i = 0; i < n; i++) {
+        double r = radius * std::sqrt(unit(gen));
+        double angle = 2 * M_PI * unit(gen);
+        double x = r * std::cos(angle);
+        double y = r * std::sin(angle);
+        particles.Add(x, y, 0.5 * y, -0.5 * x);
+    }
+
+    return particles;
+}
+
+// best of `repeats` runs, in ms
+static double TimeMs(const std::function<void()>& run, int repeats) {
+
+    double best = 1e300;
+    for (int i = 0; i < repeats; i++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    return best;
+}
+
+// mean |a - reference| / mean |reference|
+static double RelativeError(const ParticleSystem& particles, const ParticleSystem& reference) {
+
+    double error = 0;
+    double norm = 0;
+    for (std::size_t i = 0; i < reference.Size(); i++) {
+        error += std::hypot(particles.ax[i] - reference.ax[i], particles.ay[i] - reference.ay[i]);
+        norm += std::hypot(reference.ax[i], reference.ay[i]);
+    }
+
+    return (norm > 0) ? error / norm : 0.0;
+}
+
+static void RunDirectSum(DirectSum& direct_sum, ParticleSystem& particles, ThreadPool& pool) {
+    particles.ResetAccels(0, particles.Size());
+    direct_sum.CalcAccels(particles, pool);
+}
+
+// cache-blocked tiles against the row streaming mt_CalcParticleAccels loop (tile size 0)
+static bool BenchTiling(ThreadPool& pool) {
+
+    std::cout << std::format("\n== tiled all-pairs ({} threads) ==\n", pool.GetNumThreads());
+    std::cout << std::format("{:>8} {:>8} {:>12} {:>10} {:>12}\n", "N", "tile", "time (ms)", "speedup", "rel error");
+
+    for (int n : {1000, 10000, 50000}) {
+        ParticleSystem reference = SpiralDisk(n, 0.25 * std::sqrt(n) * 20, 1);
+        int repeats = (n <= 10000) ? 5 : 1;
+
+        DirectSum untiled;
+        untiled.SetTileSize(0);
+        double base_ms = TimeMs([&] { RunDirectSum(untiled, reference, pool); }, repeats);
+        std::cout << std::format("{:>8} {:>8} {:>12.2f} {:>10.2f} {:>12}\n", n, "rows", base_ms, 1.0, "-");
+
+        for (int tile_size : {64, 128, 256, 512, 1024}) {
+            ParticleSystem particles = reference;
+            DirectSum tiled;
+            tiled.SetTileSize(tile_size);
+            double ms = TimeMs([&] { RunDirectSum(tiled, particles, pool); }, repeats);
+            std::cout << std::format("{:>8} {:>8} {:>12.2f} {:>10.2f} {:>12.2e}\n", 
+                n, tile_size, ms, base_ms / ms, RelativeError(particles, reference));
+        }
+    }
+
+    return true;
+}
+
+// vector kernels against the double precision halved pass, fails above the tolerance
+static bool BenchSimd(ThreadPool& pool) {
+
+    const double tolerance = 1e-4;
+    bool passed = true;
+
+    std::cout << std::format("\n== vectorized all-pairs ({} threads, detected {}) ==\n", 
+        pool.GetNumThreads(), SimdLevelName(DetectSimdLevel()));
+    std::cout << std::format("{:>8} {:>8} {:>12} {:>10} {:>12}\n", "N", "kernel", "time (ms)", "speedup", "rel error");
+
+    SimdLevel detected = DetectSimdLevel();
+    for (int n : {1000, 10000, 50000}) {
+        ParticleSystem reference = SpiralDisk(n, 0.25 * std::sqrt(n) * 20, 2);
+        int repeats = (n <= 10000) ? 5 : 1;
+
+        DirectSum scalar;
+        double base_ms = TimeMs([&] { RunDirectSum(scalar, reference, pool); }, repeats);
+        std::cout << std::format("{:>8} {:>8} {:>12.2f} {:>10.2f} {:>12}\n", n, "double", base_ms, 1.0, "-");
+
+        for (SimdLevel level : {SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+            if (level > detected) {
+                continue;
+            }
+
+            ParticleSystem particles = reference;
+            DirectSum vectorized;
+            vectorized.SetSimdLevel(level);
+            double ms = TimeMs([&] { RunDirectSum(vectorized, particles, pool); }, repeats);
+            double error = RelativeError(particles, reference);
+            passed = passed && error < tolerance;
+            std::cout << std::format("{:>8} {:>8} {:>12.2f} {:>10.2f} {:>12.2e}{}\n", 
+                n, SimdLevelName(level), ms, base_ms / ms, error, (error < tolerance) ? "" : "  FAIL");
+        }
+    }
+
+    return passed;
+}
+
+// Energy drift of each integrator on the default spiral scene (exact vectorized
+// forces) over the same simulated time at growing dt, and how much more
+// simulated time per wall second leapfrog/Verlet get at the drift Euler has
+// at the default dt.
+static bool BenchEnergy(ThreadPool& pool) {
+
+    const double default_dt = 0.25 / 60;
+    const double sim_time = 1.0; // 240 steps at the default dt
+    const int checks = 16;       // energy samples per run
+
+    std::cout << std::format("\n== integrator energy drift ({} threads) ==\n", pool.GetNumThreads());
+    std::cout << std::format("{:>10} {:>10} {:>8} {:>12} {:>14} {:>12}\n", "integrator", "dt", "steps", "ms/step", "sim time/s", "max drift");
+
+    struct Run {
+        Integrator integrator;
+        int dt_factor;
+        double sim_rate; // simulated time per wall second
+        double drift;    // max |E - E0| / |E0|
+    };
+    std::vector<Run> runs;
+
+    for (Integrator integrator : {Integrator::Euler, Integrator::Leapfrog, Integrator::VelocityVerlet}) {
+        for (int dt_factor : {1, 2, 4, 8}) {
+            double dt = default_dt * dt_factor;
+            int steps = std::lround(sim_time / dt);
+
+            // same spiral as main.cpp, the tree root follows the particles so the boundary only matters when periodic
+            Simulation sim(Quad(-16000, -16000, 32000, 32000), dt, pool.GetNumThreads(), 1);
+            sim.GetDirectSum().SetSimdLevel(DetectSimdLevel());
+            sim.SetIntegrator(integrator);
+            sim.SpawnSpiral(800, 450, 400, 5);
+
+            double initial_energy = sim.GetStats().kinetic_energy + sim.CalcPotentialEnergy();
+            double drift = 0;
+            double total_ms = 0;
+            for (int step = 1; step <= steps; step++) {
+                sim.Step();
+                total_ms += sim.GetStats().step_ms;
+
+                if (step % std::max(1, steps / checks) == 0 || step == steps) {
+                    double energy = sim.GetStats().kinetic_energy + sim.CalcPotentialEnergy();
+                    drift = std::max(drift, std::abs(energy - initial_energy) / std::abs(initial_energy));
+                }
+            }
+
+            double ms_per_step = total_ms / steps;
+            double sim_rate = dt * 1000 / ms_per_step;
+            runs.push_back({integrator, dt_factor, sim_rate, drift});
+            std::cout << std::format("{:>10} {:>10.5f} {:>8} {:>12.2f} {:>14.4f} {:>12.2e}\n", 
+                IntegratorName(integrator), dt, steps, ms_per_step, sim_rate, drift);
+        }
+    }
+
+    // Euler at the default dt is the accuracy (and speed) baseline
+    const Run& baseline = runs.front();
+    std::cout << std::format("\nat Euler's drift with the default dt ({:.2e}):\n", baseline.drift);
+    for (Integrator integrator : {Integrator::Euler, Integrator::Leapfrog, Integrator::VelocityVerlet}) {
+        const Run* best = nullptr;
+        for (const Run& run : runs) {
+            if (run.integrator == integrator && run.drift <= baseline.drift && (!best || run.sim_rate > best->sim_rate)) {
+                best = &run;
+            }
+        }
+        if (best) {
+            std::cout << std::format("{:>10}: dt x{}, {:.2f}x the simulated time per second\n", 
+                IntegratorName(integrator), best->dt_factor, best->sim_rate / baseline.sim_rate);
+        }
+        else {
+            std::cout << std::format("{:>10}: drifts more at every dt tried\n", IntegratorName(integrator));
+        }
+    }
+
+    return true;
+}
+
+// Block timesteps against one global leapfrog dt on the default spiral scene:
+// the global step at the block scheme's finest dt resolves the close
+// encounters as well, the one at its coarsest dt shows what they cost.
+static bool BenchBlockSteps(ThreadPool& pool) {
+
+    const double dt = 4 * 0.25 / 60; // coarse step, 4x the default
+    const int max_level = 4;
+    const double sim_time = 2.0;
+
+    std::cout << std::format("\n== block timesteps ({} threads, {} levels) ==\n", pool.GetNumThreads(), max_level);
+    std::cout << std::format("{:>16} {:>10} {:>14} {:>12} {:>12} {:>12}\n", 
+        "scheme", "dt", "evals/time", "evals ratio", "time (ms)", "max drift");
+
+    struct Config {
+        const char* name;
+        double dt;
+        int block_levels;
+    };
+    const Config configs[] = {
+        {"global fine", dt / (1 << max_level), 0},
+        {"global coarse", dt, 0},
+        {"block", dt, max_level},
+    };
+
+    double fine_evals = 0;
+    for (const Config& config : configs) {
+        Simulation sim(Quad(-16000, -16000, 32000, 32000), config.dt, pool.GetNumThreads(), 1);
+        sim.GetDirectSum().SetSimdLevel(DetectSimdLevel());
+        sim.SetIntegrator(Integrator::Leapfrog);
+        sim.SetBlockLevels(config.block_levels);
+        sim.SpawnSpiral(800, 450, 400, 5);
+
+        int steps = std::lround(sim_time / config.dt);
+        double initial_energy = sim.GetStats().kinetic_energy + sim.CalcPotentialEnergy();
+        double drift = 0;
+        double total_ms = 0;
+        long long evals = 0;
+        for (int step = 1; step <= steps; step++) {
+            sim.Step();
+            SimulationStats stats = sim.GetStats();
+            total_ms += stats.step_ms;
+            evals += stats.force_evals;
+
+            if (step % std::max(1, steps / 16) == 0 || step == steps) {
+                double energy = stats.kinetic_energy + sim.CalcPotentialEnergy();
+                drift = std::max(drift, std::abs(energy - initial_energy) / std::abs(initial_energy));
+            }
+        }
+
+        if (fine_evals == 0) {
+            fine_evals = evals;
+        }
+        std::cout << std::format("{:>16} {:>10.5f} {:>14.3e} {:>12.3f} {:>12.1f} {:>12.2e}\n", 
+            config.name, config.dt, evals / sim_time, evals / fine_evals, total_ms, drift);
+
+        if (config.block_levels > 0) {
+            // where the particles ended up
+            std::vector<int> histogram(max_level + 1, 0);
+            for (std::size_t i = 0; i < sim.GetParticles().Size(); i++) {
+                histogram[sim.GetParticles().level[i]]++;
+            }
+            std::cout << "    particles per level:";
+            for (int count : histogram) {
+                std::cout << ' ' << count;
+            }
+            std::cout << '\n';
+        }
+    }
+
+    return true;
+}
+
+// mean |a - reference| / mean |reference| over the sampled particles
+static double SampleError(const ParticleSystem& particles, const ParticleSystem& reference, const std::vector<int>& sample) {
+
+    double error = 0;
+    double norm = 0;
+    for (int i : sample) {
+        error += std::hypot(particles.ax[i] - reference.ax[i], particles.ay[i] - reference.ay[i]);
+        norm += std::hypot(reference.ax[i], reference.ay[i]);
+    }
+
+    return (norm > 0) ? error / norm : 0.0;
+}
+
+// FMM at several orders and Barnes-Hut against the double precision direct
+// sum, which is only evaluated for a random sample of 1000 particles (its
+// full cost is extrapolated from that)
+static bool BenchMultipole(ThreadPool& pool) {
+
+    const int sample_size = 1000;
+
+    std::cout << std::format("\n== fast multipole ({} threads) ==\n", pool.GetNumThreads());
+    std::cout << std::format("{:>8} {:>14} {:>8} {:>12} {:>10} {:>12}\n", "N", "solver", "depth", "time (ms)", "speedup", "rel error");
+
+    for (int n : {10000, 100000, 1000000}) {
+        ParticleSystem reference = SpiralDisk(n, 0.25 * std::sqrt(n) * 20, 3);
+
+        std::mt19937 gen(4);
+        std::uniform_int_distribution<int> pick(0, n - 1);
+        std::vector<int> sample(sample_size);
+        for (int& i : sample) {
+            i = pick(gen);
+        }
+
+        DirectSum direct_sum;
+        double sample_ms = TimeMs([&] { direct_sum.CalcActiveAccels(reference, sample, pool); }, 1);
+        double direct_ms = sample_ms * n / sample_size;
+        std::cout << std::format("{:>8} {:>14} {:>8} {:>12.1f} {:>10.2f} {:>12}\n", n, "direct (est.)", "-", direct_ms, 1.0, "-");
+
+        // Barnes-Hut on a root square covering the disk
+        {
+            int half_width = static_cast<int>(0.25 * std::sqrt(n) * 20) + 1;
+            ParticleSystem particles = reference;
+            double ms = TimeMs([&] {
+                QuadTree quad_tree(2);
+                quad_tree.Build(Quad(-half_width, -half_width, 2 * half_width, 2 * half_width), particles);
+                pool.ParallelFor(0, n, [&](int start, int end) {
+                    for (int i = start; i < end; i++) {
+                        quad_tree.CalcAccel(i, 0.5, particles.ax[i], particles.ay[i]);
+                    }
+                });
+            }, 1);
+            std::cout << std::format("{:>8} {:>14} {:>8} {:>12.1f} {:>10.2f} {:>12.2e}\n", 
+                n, "BH theta 0.5", "-", ms, direct_ms / ms, SampleError(particles, reference, sample));
+        }
+
+        for (int order : {2, 4, 6, 8, 10}) {
+            ParticleSystem particles = reference;
+            FastMultipole fast_multipole(order);
+            double ms = TimeMs([&] { fast_multipole.CalcAccels(particles, pool); }, (n <= 100000) ? 3 : 1);
+            std::cout << std::format("{:>8} {:>14} {:>8} {:>12.1f} {:>10.2f} {:>12.2e}\n", 
+                n, std::format("FMM order {}", order), fast_multipole.GetDepth(), ms, direct_ms / ms, SampleError(particles, reference, sample));
+        }
+    }
+
+    return true;
+}
+
+// particle-mesh grid sizes against the sampled direct sum, then a periodic
+// run that has to keep every particle and all of its mass
+static bool BenchParticleMesh(ThreadPool& pool) {
+
+    const int sample_size = 1000;
+
+    std::cout << std::format("\n== particle mesh ({} threads) ==\n", pool.GetNumThreads());
+    std::cout << std::format("{:>8} {:>14} {:>12} {:>10} {:>12}\n", "N", "solver", "time (ms)", "speedup", "rel error");
+
+    for (int n : {100000, 1000000}) {
+        ParticleSystem reference = SpiralDisk(n, 0.25 * std::sqrt(n) * 20, 3);
+
+        std::mt19937 gen(4);
+        std::uniform_int_distribution<int> pick(0, n - 1);
+        std::vector<int> sample(sample_size);
+        for (int& i : sample) {
+            i = pick(gen);
+        }
+
+        DirectSum direct_sum;
+        double sample_ms = TimeMs([&] { direct_sum.CalcActiveAccels(reference, sample, pool); }, 1);
+        double direct_ms = sample_ms * n / sample_size;
+        std::cout << std::format("{:>8} {:>14} {:>12.1f} {:>10.2f} {:>12}\n", n, "direct (est.)", direct_ms, 1.0, "-");
+
+        for (int grid : {128, 256, 512, 1024, 2048}) {
+            ParticleSystem particles = reference;
+            ParticleMesh particle_mesh(grid);
+            particle_mesh.CalcAccels(particles, pool); // kernel transforms are built on the first pass
+            double ms = TimeMs([&] { particle_mesh.CalcAccels(particles, pool); }, (grid <= 512) ? 3 : 1);
+            std::cout << std::format("{:>8} {:>14} {:>12.1f} {:>10.2f} {:>12.2e}\n", 
+                n, std::format("PM {}^2", grid), ms, direct_ms / ms, SampleError(particles, reference, sample));
+        }
+
+        ParticleSystem particles = reference;
+        FastMultipole fast_multipole;
+        double ms = TimeMs([&] { fast_multipole.CalcAccels(particles, pool); }, 1);
+        std::cout << std::format("{:>8} {:>14} {:>12.1f} {:>10.2f} {:>12.2e}\n", 
+            n, "FMM order 6", ms, direct_ms / ms, SampleError(particles, reference, sample));
+    }
+
+    // the default spiral in a box barely wider than it, so particles cross the edges
+    Simulation sim(Quad(-100, -100, 1200, 1200), 0.25 / 60, pool.GetNumThreads(), 5);
+    sim.SetSolver(ForceSolver::ParticleMesh);
+    sim.SetIntegrator(Integrator::Leapfrog);
+    sim.SetPeriodic(true);
+    sim.SpawnSpiral(500, 500, 1000, 5);
+    SimulationStats start = sim.GetStats();
+    double ms = TimeMs([&] {
+        for (int step = 0; step < 600; step++) {
+            sim.Step();
+        }
+    }, 1);
+    SimulationStats end = sim.GetStats();
+    bool kept = (end.num_particles == start.num_particles && std::abs(end.total_mass - start.total_mass) <= 1e-6 * std::abs(start.total_mass));
+    std::cout << std::format("periodic: {} -> {} particles, mass {} -> {} over 600 steps ({:.2f} ms/step) {}\n", 
+        start.num_particles, end.num_particles, start.total_mass, end.total_mass, ms / 600, kept ? "ok" : "FAILED");
+
+    return kept;
+}
+
+// the recursive quad tree build against the linear one (Morton keys and a
+// radix sort), which has to give the same tree, then updating the tree
+// after a drift against rebuilding it, to tune the rebuild fraction
+static bool BenchTreeBuild(ThreadPool& pool) {
+
+    std::cout << std::format("\n== quad tree build ({} threads) ==\n", pool.GetNumThreads());
+    std::cout << std::format("{:>8} {:>14} {:>12} {:>10} {:>10}\n", "N", "build", "time (ms)", "speedup", "nodes");
+
+    bool same = true;
+    for (int n : {100000, 1000000}) {
+        ParticleSystem particles = SpiralDisk(n, 0.25 * std::sqrt(n) * 20, 3);
+        int half_width = static_cast<int>(0.25 * std::sqrt(n) * 20) + 1;
+        Quad boundary(-half_width, -half_width, 2 * half_width, 2 * half_width);
+
+        // built once before timing, so both run on storage that has already grown
+        QuadTree recursive(2);
+        recursive.Build(boundary, particles);
+        double recursive_ms = TimeMs([&] { recursive.Build(boundary, particles); }, 3);
+        std::cout << std::format("{:>8} {:>14} {:>12.1f} {:>10.2f} {:>10}\n", n, "recursive", recursive_ms, 1.0, recursive.GetNodeCount());
+
+        QuadTree linear(2);
+        linear.Build(boundary, particles, pool);
+        double linear_ms = TimeMs([&] { linear.Build(boundary, particles, pool); }, 3);
+        std::cout << std::format("{:>8} {:>14} {:>12.1f} {:>10.2f} {:>10}\n", n, "linear", linear_ms, recursive_ms / linear_ms, linear.GetNodeCount());
+
+        std::vector<int> found_recursive;
+        std::vector<int> found_linear;
+        recursive.Query(Quad(-half_width / 4, -half_width / 4, half_width / 2, half_width / 2), found_recursive);
+        linear.Query(Quad(-half_width / 4, -half_width / 4, half_width / 2, half_width / 2), found_linear);
+        same = same && linear.GetNodeCount() == recursive.GetNodeCount() && found_linear.size() == found_recursive.size();
+    }
+    std::cout << (same ? "same trees ok\n" : "trees differ FAILED\n");
+
+    // the simulation's leaf size, and several consecutive steps so updates
+    // also run on trees that earlier updates left behind
+    const int capacity = 16;
+    const int steps = 10;
+    std::cout << std::format("\n{:>8} {:>10} {:>10} {:>12} {:>12}   (leaf size {}, per step over {} steps)\n", 
+        "N", "drift dt", "moved", "update (ms)", "build (ms)", capacity, steps);
+    for (int n : {100000, 1000000}) {
+        int half_width = static_cast<int>(0.25 * std::sqrt(n) * 20) + 1;
+        Quad boundary(-half_width, -half_width, 2 * half_width, 2 * half_width);
+
+        // the disk spins fast at its edge, so fractions of the default time step
+        for (int fraction : {64, 16, 4, 1}) {
+            ParticleSystem particles = SpiralDisk(n, 0.25 * std::sqrt(n) * 20, 3);
+            QuadTree updated(capacity);
+            QuadTree rebuilt(capacity);
+            updated.Build(boundary, particles, pool);
+            rebuilt.Build(boundary, particles, pool);
+
+            // each state is updated once, so the rebuild is timed once per state too
+            double update_ms = 0;
+            double build_ms = 0;
+            long long moved = 0;
+            for (int step = 0; step < steps; step++) {
+                particles.Drift(0.25 / 60 / fraction, 0, n);
+                update_ms += TimeMs([&] { updated.Update(boundary, particles, pool, 1.0); }, 1);
+                build_ms += TimeMs([&] { rebuilt.Build(boundary, particles, pool); }, 1);
+                moved += updated.GetMovedCount();
+                same = same && updated.GetNodeCount() == rebuilt.GetNodeCount();
+            }
+            std::cout << std::format("{:>8} {:>10} {:>9.1f}% {:>12.1f} {:>12.1f}\n", 
+                n, std::format("dt / {}", fraction), 100.0 * moved / (static_cast<double>(n) * steps), update_ms / steps, build_ms / steps);
+        }
+    }
+    std::cout << (same ? "updated trees ok\n" : "updated trees differ FAILED\n");
+
+    return same;
+}
+
+// the linear build at 1..max thread counts, which has to give the same tree
+// at every count, and its speedup over one thread
+static bool BenchTreeScaling() {
+
+    // powers of two up to the hardware threads, and at least up to 8
+    int max_threads = std::max(8u, std::thread::hardware_concurrency());
+    std::cout << std::format("\n== quad tree build scaling ({} hardware threads) ==\n", std::thread::hardware_concurrency());
+    std::cout << std::format("{:>8} {:>8} {:>12} {:>10} {:>10}\n", "N", "threads", "time (ms)", "speedup", "nodes");
+
+    bool same = true;
+    for (int n : {100000, 1000000}) {
+        ParticleSystem particles = SpiralDisk(n, 0.25 * std::sqrt(n) * 20, 3);
+        int half_width = static_cast<int>(0.25 * std::sqrt(n) * 20) + 1;
+        Quad boundary(-half_width, -half_width, 2 * half_width, 2 * half_width);
+
+        double single_ms = 0;
+        int single_nodes = 0;
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            ThreadPool pool(threads);
+            QuadTree tree(2);
+            tree.Build(boundary, particles, pool);
+            double ms = TimeMs([&] { tree.Build(boundary, particles, pool); }, 3);
+            if (threads == 1) {
+                single_ms = ms;
+                single_nodes = tree.GetNodeCount();
+            }
+            std::cout << std::format("{:>8} {:>8} {:>12.1f} {:>10.2f} {:>10}\n", n, threads, ms, single_ms / ms, tree.GetNodeCount());
+            same = same && tree.GetNodeCount() == single_nodes;
+        }
+    }
+    std::cout << (same ? "same trees ok\n" : "trees differ FAILED\n");
+
+    return same;
+}
+
+// a step on particles in random order (how SpiralDisk generates them)
+// against the same step after sorting them by Morton key, for the solvers
+// whose passes follow particle order through memory
+static bool BenchReorder(ThreadPool& pool) {
+
+    std::cout << std::format("\n== Morton reorder ({} threads) ==\n", pool.GetNumThreads());
+    std::cout << std::format("{:>8} {:>12} {:>14} {:>14} {:>10}\n", "N", "solver", "random (ms)", "sorted (ms)", "speedup");
+
+    bool tracked = true;
+    for (int n : {100000, 1000000}) {
+        double radius = 0.25 * std::sqrt(n) * 20;
+        for (ForceSolver solver : {ForceSolver::BarnesHut, ForceSolver::ParticleMesh}) {
+            Simulation sim(Quad(-2 * radius, -2 * radius, 4 * radius, 4 * radius), 0.25 / 60, pool.GetNumThreads(), 1);
+            sim.SetSolver(solver);
+            sim.SetReorderInterval(0);
+            sim.GetParticles() = SpiralDisk(n, radius, 3);
+
+            // warmed up once, so both run on storage that has already grown
+            sim.Step();
+            double random_ms = TimeMs([&] { sim.Step(); }, 2);
+
+            ParticleSystem before = sim.GetParticles();
+            sim.SortParticles();
+            sim.Step();
+            double sorted_ms = TimeMs([&] { sim.Step(); }, 2);
+            std::cout << std::format("{:>8} {:>12} {:>14.1f} {:>14.1f} {:>10.2f}\n", n, ForceSolverName(solver), random_ms, sorted_ms, random_ms / sorted_ms);
+
+            // every id still there once, nothing else changed by the sort
+            sim.SortParticles();
+            ParticleSystem after = sim.GetParticles();
+            std::vector<int> by_id(before.Size(), -1);
+            for (std::size_t i = 0; i < before.Size(); i++) {
+                by_id[before.id[i]] = i;
+            }
+            for (std::size_t k = 0; k < after.Size(); k++) {
+                tracked = tracked && by_id[after.id[k]] >= 0;
+                by_id[after.id[k]] = -1;
+            }
+            tracked = tracked && after.Size() == before.Size();
+        }
+    }
+    std::cout << (tracked ? "ids ok\n" : "ids FAILED\n");
+
+    return tracked;
+}
+
+// a disk with one particle ejected far out (or without it), where the root
+// of the tree and the grids must stay sized to the disk: Barnes-Hut on the
+// plain bounding square against the core square, FMM and PM, all against
+// the exact sum, plus the error on the last particle (the ejected one)
+static bool BenchEjected(ThreadPool& pool) {
+
+    const int n = 50000;
+
+    std::cout << std::format("\n== ejected particle ({} threads) ==\n", pool.GetNumThreads());
+    std::cout << std::format("{:>10} {:>14} {:>8} {:>8} {:>12} {:>12} {:>12}\n", 
+        "scene", "solver", "nodes", "outside", "time (ms)", "rel error", "last err");
+
+    bool ok = true;
+    int disk_nodes = 0;
+    double disk_step_ms = 0;
+    for (bool ejected : {false, true}) {
+        ParticleSystem reference = SpiralDisk(n, 400, 3);
+        if (ejected) {
+            reference.Add(1e7f, 1e7f);
+        }
+        const char* scene = ejected ? "ejected" : "disk";
+        int last = reference.Size() - 1;
+
+        DirectSum direct_sum;
+        direct_sum.SetSimdLevel(DetectSimdLevel());
+        RunDirectSum(direct_sum, reference, pool);
+
+        auto last_error = [&](const ParticleSystem& particles) {
+            return std::hypot(particles.ax[last] - reference.ax[last], particles.ay[last] - reference.ay[last]) / 
+                std::hypot(reference.ax[last], reference.ay[last]);
+        };
+
+        for (bool core : {false, true}) {
+            ParticleSystem particles = reference;
+            QuadTree quad_tree(16);
+            double ms = TimeMs([&] {
+                quad_tree.Build(core ? CoreSquare(particles, pool) : BoundingSquare(particles, pool), particles, pool);
+                pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+                    for (int i = start; i < end; i++) {
+                        quad_tree.CalcAccel(i, 0.5, particles.ax[i], particles.ay[i]);
+                    }
+                });
+            }, 1);
+            double error = last_error(particles);
+            std::cout << std::format("{:>10} {:>14} {:>8} {:>8} {:>12.1f} {:>12.2e} {:>12.2e}\n", 
+                scene, core ? "BH core" : "BH bounding", quad_tree.GetNodeCount(), quad_tree.GetOutsideCount(), ms, RelativeError(particles, reference), error);
+            if (core && !ejected) {
+                disk_nodes = quad_tree.GetNodeCount();
+            }
+            if (core && ejected) {
+                // the far particle must not cost the disk its depth
+                ok = ok && quad_tree.GetNodeCount() >= 0.9 * disk_nodes && quad_tree.GetOutsideCount() == 1 && error < 1e-3;
+            }
+        }
+
+        {
+            ParticleSystem particles = reference;
+            FastMultipole fast_multipole;
+            double ms = TimeMs([&] { fast_multipole.CalcAccels(particles, pool); }, 1);
+            double error = last_error(particles);
+            std::cout << std::format("{:>10} {:>14} {:>8} {:>8} {:>12.1f} {:>12.2e} {:>12.2e}\n", 
+                scene, "FMM", std::format("d {}", fast_multipole.GetDepth()), "-", ms, RelativeError(particles, reference), error);
+            ok = ok && (!ejected || error < 1e-3);
+        }
+
+        {
+            ParticleSystem particles = reference;
+            ParticleMesh particle_mesh;
+            double ms = TimeMs([&] { particle_mesh.CalcAccels(particles, pool); }, 1);
+            double error = last_error(particles);
+            std::cout << std::format("{:>10} {:>14} {:>8} {:>8} {:>12.1f} {:>12.2e} {:>12.2e}\n", 
+                scene, "PM", "-", "-", ms, RelativeError(particles, reference), error);
+            ok = ok && (!ejected || error < 1e-3);
+        }
+
+        // the simulation keeps its root on the disk and updates the tree
+        Simulation sim(Quad(-1000, -1000, 2000, 2000), 0.25 / 60, pool.GetNumThreads(), 1);
+        sim.SetSolver(ForceSolver::BarnesHut);
+        sim.GetParticles() = reference;
+        sim.Step();
+        double step_ms = TimeMs([&] {
+            for (int step = 0; step < 5; step++) {
+                sim.Step();
+            }
+        }, 1) / 5;
+        std::cout << std::format("{:>10} {:>14} {:>8} {:>8} {:>12.1f}\n", scene, "BH sim step", "-", "-", step_ms);
+        if (!ejected) {
+            disk_step_ms = step_ms;
+        }
+        else {
+            ok = ok && step_ms < 1.5 * disk_step_ms;
+        }
+    }
+    std::cout << (ok ? "ejected particle ok\n" : "ejected particle FAILED\n");
+
+    return ok;
+}
+
+int main(int argc, char** argv) {
+
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    auto selected = [&](const std::string& name) {
+        if (argc < 2) {
+            return true;
+        }
+        for (int i = 1; i < argc; i++) {
+            if (name == argv[i]) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    bool passed = true;
+    if (selected("tiling")) passed = BenchTiling(pool) && passed;
+    if (selected("simd")) passed = BenchSimd(pool) && passed;
+    if (selected("energy")) passed = BenchEnergy(pool) && passed;
+    if (selected("blocksteps")) passed = BenchBlockSteps(pool) && passed;
+    if (selected("fmm")) passed = BenchMultipole(pool) && passed;
+    if (selected("pm")) passed = BenchParticleMesh(pool) && passed;
+    if (selected("tree")) passed = BenchTreeBuild(pool) && passed;
+    if (selected("treescaling")) passed = BenchTreeScaling() && passed;
+    if (selected("reorder")) passed = BenchReorder(pool) && passed;
+    if (selected("ejected")) passed = BenchEjected(pool) && passed;
+
+    return passed ? 0 : 1;
+}
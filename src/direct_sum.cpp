@@ -0,0 +1,287 @@
+#include "direct_sum.hpp"
+#include "gravity.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+
+// pairs (i, j) for j in [j_start, j_end), accumulated into accel_x/accel_y (both directions)
+static inline void CalcRowAccels(const ParticleSystem& particles, float* accel_x, float* accel_y, int i, int j_start, int j_end) {
+
+    const float* x = particles.x.data();
+    const float* y = particles.y.data();
+    const float* mass = particles.mass.data();
+    const float* radius = particles.radius.data();
+
+    double x_i = x[i];
+    double y_i = y[i];
+    double m_i = mass[i];
+    double r_i = radius[i];
+
+    double sum_x = 0;
+    double sum_y = 0;
+    for (int j = j_start; j < j_end; j++) {
+        double d_x = x[j] - x_i;
+        double d_y = y[j] - y_i;
+        double factor;
+        if (!GravityFactor(d_x, d_y, r_i + radius[j], factor)) {
+            continue;
+        }
+
+        sum_x += factor * mass[j] * d_x;
+        sum_y += factor * mass[j] * d_y;
+        accel_x[j] -= factor * m_i * d_x;
+        accel_y[j] -= factor * m_i * d_y;
+    }
+
+    accel_x[i] += sum_x;
+    accel_y[i] += sum_y;
+}
+
+// acceleration on i from every other particle, no halving
+static void CalcFullRowAccel(const ParticleSystem& particles, int i, float& accel_x, float& accel_y) {
+
+    int n = particles.Size();
+    double sum_x = 0;
+    double sum_y = 0;
+    for (int j = 0; j < n; j++) {
+        double d_x = particles.x[j] - particles.x[i];
+        double d_y = particles.y[j] - particles.y[i];
+        double factor;
+        if (j == i || !GravityFactor(d_x, d_y, particles.radius[i] + particles.radius[j], factor)) {
+            continue;
+        }
+
+        sum_x += factor * particles.mass[j] * d_x;
+        sum_y += factor * particles.mass[j] * d_y;
+    }
+
+    accel_x = sum_x;
+    accel_y = sum_y;
+}
+
+// every pair (i in [a_start, a_end), j in [b_start, b_end), j > i), both directions.
+// With tile_size > 0 the pairs are walked tile by tile, so a tile of j (and
+// its accelerations) stays in L1 while the rows of the i tile sweep over it,
+// instead of streaming all of [b_start, b_end) past every i.
+static void CalcBlockAccels(const ParticleSystem& particles, float* accel_x, float* accel_y, int a_start, int a_end, int b_start, int b_end, int tile_size) {
+
+    if (tile_size <= 0) {
+        for (int i = a_start; i < a_end; i++) {
+            CalcRowAccels(particles, accel_x, accel_y, i, std::max(b_start, i + 1), b_end);
+        }
+        return;
+    }
+
+    for (int i_start = a_start; i_start < a_end; i_start += tile_size) {
+        int i_end = std::min(i_start + tile_size, a_end);
+
+        // the first j tile starts at the i tile itself when the blocks overlap
+        for (int j_start = std::max(b_start, i_start); j_start < b_end; j_start += tile_size) {
+            int j_end = std::min(j_start + tile_size, b_end);
+            for (int i = i_start; i < i_end; i++) {
+                CalcRowAccels(particles, accel_x, accel_y, i, std::max(j_start, i + 1), j_end);
+            }
+        }
+    }
+}
+
+// accumulates the pairs (i, j > i) for i in [start, end) into accel_x/accel_y
+void mt_CalcParticleAccels(const ParticleSystem& particles, float* accel_x, float* accel_y, int start, int end, int tile_size) {
+    CalcBlockAccels(particles, accel_x, accel_y, start, end, start, particles.Size(), tile_size);
+}
+
+// every pair between block a and block b (a <= b), only writes to those two blocks
+static void CalcTileAccels(ParticleSystem& particles, int a_start, int a_end, int b_start, int b_end, int tile_size) {
+    CalcBlockAccels(particles, particles.ax.data(), particles.ay.data(), a_start, a_end, b_start, b_end, tile_size);
+}
+
+// first row of each of the num_threads ranges (plus n at the end) such that
+// every range holds the same number of (i, j > i) pairs
+static std::vector<int> TriangularPartition(int n, int num_threads) {
+
+    std::vector<int> bounds(num_threads + 1, n);
+    bounds[0] = 0;
+
+    // rows [0, i) hold i(n - 1) - i(i - 1)/2 pairs, invert that for the target work
+    double total_pairs = 0.5 * n * (n - 1.0);
+    double b = n - 0.5;
+    for (int t = 1; t < num_threads; t++) {
+        double work = total_pairs * t / num_threads;
+        int row = static_cast<int>(std::round(b - std::sqrt(std::max(0.0, b * b - 2 * work))));
+        bounds[t] = std::clamp(row, bounds[t - 1], n);
+    }
+
+    return bounds;
+}
+
+static std::vector<int> EqualPartition(int n, int num_threads) {
+
+    std::vector<int> bounds(num_threads + 1);
+    for (int t = 0; t <= num_threads; t++) {
+        bounds[t] = static_cast<int>(static_cast<long long>(n) * t / num_threads);
+    }
+
+    return bounds;
+}
+
+static double ElapsedMs(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+DirectSum::DirectSum(bool deterministic, int num_blocks) :
+    deterministic(deterministic),
+    balanced(true),
+    simd_level(SimdLevel::Scalar),
+    num_blocks(num_blocks + num_blocks % 2),
+    tile_size(256) {}
+
+void DirectSum::CalcAccels(ParticleSystem& particles, ThreadPool& pool) {
+
+    int n = particles.Size();
+    int num_threads = pool.GetNumThreads();
+
+    thread_times.assign(num_threads, 0.0);
+
+    if (simd_level != SimdLevel::Scalar) {
+        // every row costs the same here, so equal ranges are balanced
+        std::vector<int> bounds = EqualPartition(n, num_threads);
+
+        pool.Run([&](int thread_id, int) {
+            auto busy_start = std::chrono::steady_clock::now();
+            CalcAccelsSimd(particles, particles.ax.data(), particles.ay.data(), bounds[thread_id], bounds[thread_id + 1], simd_level);
+            thread_times[thread_id] += ElapsedMs(busy_start);
+        });
+    }
+    else if (deterministic) {
+        int b = num_blocks;
+        auto block_start = [n, b](int block) { return static_cast<int>(static_cast<long long>(n) * block / b); };
+
+        pool.Run([&](int thread_id, int num_threads) {
+            // round 0 is the diagonal tiles, then b - 1 rounds of b / 2 disjoint tiles (circle method)
+            auto busy_start = std::chrono::steady_clock::now();
+            for (int block = thread_id; block < b; block += num_threads) {
+                CalcTileAccels(particles, block_start(block), block_start(block + 1), block_start(block), block_start(block + 1), tile_size);
+            }
+            thread_times[thread_id] += ElapsedMs(busy_start);
+            pool.Sync();
+
+            for (int round = 0; round < b - 1; round++) {
+                busy_start = std::chrono::steady_clock::now();
+                for (int k = thread_id; k < b / 2; k += num_threads) {
+                    int block_a = (k == 0) ? b - 1 : (round + k) % (b - 1);
+                    int block_b = (k == 0) ? round : (round - k + b - 1) % (b - 1);
+                    if (block_a > block_b) {
+                        std::swap(block_a, block_b);
+                    }
+                    CalcTileAccels(particles, block_start(block_a), block_start(block_a + 1), block_start(block_b), block_start(block_b + 1), tile_size);
+                }
+                thread_times[thread_id] += ElapsedMs(busy_start);
+                pool.Sync();
+            }
+        });
+    }
+    else {
+        thread_accels.resize(num_threads);
+
+        std::vector<int> bounds = balanced ? TriangularPartition(n, num_threads) : EqualPartition(n, num_threads);
+        std::vector<int> reduce_bounds = EqualPartition(n, num_threads);
+
+        pool.Run([&](int thread_id, int num_threads) {
+            auto busy_start = std::chrono::steady_clock::now();
+            int start = bounds[thread_id];
+            int end = bounds[thread_id + 1];
+
+            // this thread only ever writes to indices >= start
+            AccelBuffer& accels = thread_accels[thread_id];
+            accels.ax.resize(n);
+            accels.ay.resize(n);
+            std::fill(accels.ax.begin() + start, accels.ax.end(), 0.0f);
+            std::fill(accels.ay.begin() + start, accels.ay.end(), 0.0f);
+
+            mt_CalcParticleAccels(particles, accels.ax.data(), accels.ay.data(), start, end, tile_size);
+            thread_times[thread_id] += ElapsedMs(busy_start);
+            pool.Sync();
+
+            // reduce in equal index ranges, buffer t holds nothing below bounds[t]
+            busy_start = std::chrono::steady_clock::now();
+            for (int i = reduce_bounds[thread_id]; i < reduce_bounds[thread_id + 1]; i++) {
+                for (int t = 0; t < num_threads && bounds[t] <= i; t++) {
+                    particles.ax[i] += thread_accels[t].ax[i];
+                    particles.ay[i] += thread_accels[t].ay[i];
+                }
+            }
+            thread_times[thread_id] += ElapsedMs(busy_start);
+        });
+    }
+}
+
+void DirectSum::CalcActiveAccels(ParticleSystem& particles, const std::vector<int>& active, ThreadPool& pool) {
+
+    int num_threads = pool.GetNumThreads();
+    thread_times.assign(num_threads, 0.0);
+
+    // every active row costs N pairs, so equal ranges of the list are balanced
+    std::vector<int> bounds = EqualPartition(active.size(), num_threads);
+
+    pool.Run([&](int thread_id, int) {
+        auto busy_start = std::chrono::steady_clock::now();
+        if (simd_level != SimdLevel::Scalar) {
+            CalcAccelsSimd(particles, particles.ax.data(), particles.ay.data(), active.data(), bounds[thread_id], bounds[thread_id + 1], simd_level);
+        }
+        else {
+            for (int k = bounds[thread_id]; k < bounds[thread_id + 1]; k++) {
+                CalcFullRowAccel(particles, active[k], particles.ax[active[k]], particles.ay[active[k]]);
+            }
+        }
+        thread_times[thread_id] += ElapsedMs(busy_start);
+    });
+}
+
+void DirectSum::SetDeterministic(bool deterministic) {
+    this->deterministic = deterministic;
+}
+
+bool DirectSum::IsDeterministic() const {
+    return deterministic;
+}
+
+void DirectSum::SetTileSize(int tile_size) {
+    this->tile_size = std::max(0, tile_size);
+}
+
+int DirectSum::GetTileSize() const {
+    return tile_size;
+}
+
+void DirectSum::SetSimdLevel(SimdLevel simd_level) {
+    this->simd_level = simd_level;
+}
+
+SimdLevel DirectSum::GetSimdLevel() const {
+    return simd_level;
+}
+
+void DirectSum::SetBalanced(bool balanced) {
+    this->balanced = balanced;
+}
+
+bool DirectSum::IsBalanced() const {
+    return balanced;
+}
+
+const std::vector<double>& DirectSum::GetThreadTimes() const {
+    return thread_times;
+}
+
+double DirectSum::GetImbalance() const {
+
+    if (thread_times.empty()) {
+        return 1.0;
+    }
+
+    double total = std::accumulate(thread_times.begin(), thread_times.end(), 0.0);
+    double slowest = *std::max_element(thread_times.begin(), thread_times.end());
+    return (total > 0) ? slowest * thread_times.size() / total : 1.0;
+}
\ No newline at end of file
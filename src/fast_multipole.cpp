@@ -0,0 +1,464 @@
+#include "fast_multipole.hpp"
+#include "gravity.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+FastMultipole::FastMultipole(int order, int leaf_size) :
+    simd_level(DetectSimdLevel()),
+    depth(0),
+    root_x(0),
+    root_y(0),
+    root_width(1),
+    num_inside(0) {
+    SetOrder(order);
+    SetLeafSize(leaf_size);
+}
+
+// coefficients are stored by total degree, x^a y^b at d(d + 1)/2 + b with d = a + b
+int FastMultipole::Index(int a, int b) const {
+    int d = a + b;
+    return d * (d + 1) / 2 + b;
+}
+
+double FastMultipole::Binomial(int n, int k) const {
+    return binomial[n * (2 * order + 1) + k];
+}
+
+// with g = |r|^2 the coefficients b_k = D^k (1/|r|) / k! satisfy
+// |k| g b_k = -(2|k| - 1) sum_i r_i b_(k - e_i) - (|k| - 1) sum_i b_(k - 2 e_i)
+void FastMultipole::CalcDerivatives(double r_x, double r_y, double* coeffs) const {
+
+    double g = r_x * r_x + r_y * r_y;
+    coeffs[0] = 1 / std::sqrt(g);
+
+    for (int d = 1; d <= order; d++) {
+        for (int b = 0; b <= d; b++) {
+            int a = d - b;
+            double first = 0;
+            double second = 0;
+            if (a > 0) first += r_x * coeffs[Index(a - 1, b)];
+            if (b > 0) first += r_y * coeffs[Index(a, b - 1)];
+            if (a > 1) second += coeffs[Index(a - 2, b)];
+            if (b > 1) second += coeffs[Index(a, b - 2)];
+            coeffs[Index(a, b)] = (-(2 * d - 1) * first - (d - 1) * second) / (d * g);
+        }
+    }
+}
+
+void FastMultipole::BuildTree(const ParticleSystem& particles, ThreadPool& pool) {
+
+    int n = particles.Size();
+    int num_threads = pool.GetNumThreads();
+
+    // largest radius, one partial result per thread
+    std::vector<float> partial(num_threads);
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+        float max_radius = 0.0f;
+        for (int i = start; i < end; i++) {
+            max_radius = std::max(max_radius, particles.radius[i]);
+        }
+        partial[thread_id] = max_radius;
+    });
+    float max_radius = *std::max_element(partial.begin(), partial.end());
+
+    // the core square, the few particles outside it are summed directly
+    Quad root = CoreSquare(particles, pool);
+    root_x = root.x;
+    root_y = root.y;
+    root_width = root.width;
+
+    // deepen until the leaves hold about leaf_size particles, but never below the cutoff length
+    double cutoff_length = 40.0 * max_radius;
+    depth = 0;
+    while (depth < 12 && (static_cast<long long>(leaf_size) << (2 * depth)) < n && root_width / (2 << depth) >= cutoff_length) {
+        depth++;
+    }
+
+    levels.resize(depth + 1);
+    for (int l = 0; l <= depth; l++) {
+        Level& level = levels[l];
+        level.dim = 1 << l;
+        level.width = root_width / level.dim;
+        level.count.assign(level.dim * level.dim, 0);
+        level.multipoles.assign(level.dim * level.dim * num_coeffs, 0.0);
+        level.locals.assign(level.dim * level.dim * num_coeffs, 0.0);
+
+        // interaction list offsets are at most 3 cells each way, neighbours stay zero
+        level.m2l.assign(49 * num_coeffs, 0.0);
+        for (int d_y = -3; d_y <= 3; d_y++) {
+            for (int d_x = -3; d_x <= 3; d_x++) {
+                if (std::abs(d_x) > 1 || std::abs(d_y) > 1) {
+                    CalcDerivatives(d_x * level.width, d_y * level.width, &level.m2l[((d_y + 3) * 7 + d_x + 3) * num_coeffs]);
+                }
+            }
+        }
+    }
+
+    // counting sort of the particles into leaves, the ones outside the root
+    // (leaf -1) go after the last leaf
+    Level& leaves = levels[depth];
+    int dim = leaves.dim;
+    leaf_of.resize(n);
+    pool.ParallelFor(0, n, [&](int start, int end) {
+        for (int i = start; i < end; i++) {
+            if (!root.Contains(Point(particles.x[i], particles.y[i]))) {
+                leaf_of[i] = -1;
+                continue;
+            }
+            int cell_x = std::min(dim - 1, static_cast<int>((particles.x[i] - root_x) / leaves.width));
+            int cell_y = std::min(dim - 1, static_cast<int>((particles.y[i] - root_y) / leaves.width));
+            leaf_of[i] = cell_y * dim + cell_x;
+        }
+    });
+
+    for (int i = 0; i < n; i++) {
+        if (leaf_of[i] >= 0) {
+            leaves.count[leaf_of[i]]++;
+        }
+    }
+    leaf_start.assign(dim * dim + 1, 0);
+    for (int c = 0; c < dim * dim; c++) {
+        leaf_start[c + 1] = leaf_start[c] + leaves.count[c];
+    }
+    num_inside = leaf_start[dim * dim];
+    std::vector<int> next(leaf_start.begin(), leaf_start.end() - 1);
+    int next_outside = num_inside;
+    sorted.resize(n);
+    for (int i = 0; i < n; i++) {
+        sorted[leaf_of[i] >= 0 ? next[leaf_of[i]]++ : next_outside++] = i;
+    }
+
+    // copy the particles in leaf order so each leaf is contiguous
+    sorted_x.resize(n);
+    sorted_y.resize(n);
+    sorted_mass.resize(n);
+    sorted_radius.resize(n);
+    pool.ParallelFor(0, n, [&](int start, int end) {
+        for (int k = start; k < end; k++) {
+            int i = sorted[k];
+            sorted_x[k] = particles.x[i];
+            sorted_y[k] = particles.y[i];
+            sorted_mass[k] = particles.mass[i];
+            sorted_radius[k] = particles.radius[i];
+        }
+    });
+
+    // counts of the coarser levels
+    for (int l = depth - 1; l >= 0; l--) {
+        Level& level = levels[l];
+        const Level& child = levels[l + 1];
+        for (int c_y = 0; c_y < child.dim; c_y++) {
+            for (int c_x = 0; c_x < child.dim; c_x++) {
+                level.count[(c_y / 2) * level.dim + c_x / 2] += child.count[c_y * child.dim + c_x];
+            }
+        }
+    }
+}
+
+void FastMultipole::Upward(ThreadPool& pool) {
+
+    // P2M: moments sum m (c - x_j)^k of every leaf about its center
+    Level& leaves = levels[depth];
+    pool.ParallelFor(0, leaves.dim * leaves.dim, [&](int start, int end) {
+        std::vector<double> pow_x(order + 1), pow_y(order + 1);
+        for (int cell = start; cell < end; cell++) {
+            if (leaves.count[cell] == 0) {
+                continue;
+            }
+
+            double center_x = root_x + (cell % leaves.dim + 0.5) * leaves.width;
+            double center_y = root_y + (cell / leaves.dim + 0.5) * leaves.width;
+            double* multipole = &leaves.multipoles[cell * num_coeffs];
+            for (int k = leaf_start[cell]; k < leaf_start[cell + 1]; k++) {
+                pow_x[0] = sorted_mass[k];
+                pow_y[0] = 1.0;
+                for (int p = 1; p <= order; p++) {
+                    pow_x[p] = pow_x[p - 1] * (center_x - sorted_x[k]);
+                    pow_y[p] = pow_y[p - 1] * (center_y - sorted_y[k]);
+                }
+                for (int d = 0; d <= order; d++) {
+                    for (int b = 0; b <= d; b++) {
+                        multipole[Index(d - b, b)] += pow_x[d - b] * pow_y[b];
+                    }
+                }
+            }
+        }
+    });
+
+    // M2M: shift the children's moments to the parent center, s = parent - child
+    for (int l = depth - 1; l >= 0; l--) {
+        Level& level = levels[l];
+        const Level& child = levels[l + 1];
+        pool.ParallelFor(0, level.dim * level.dim, [&](int start, int end) {
+            std::vector<double> pow_x(order + 1), pow_y(order + 1);
+            for (int cell = start; cell < end; cell++) {
+                if (level.count[cell] == 0) {
+                    continue;
+                }
+
+                double* multipole = &level.multipoles[cell * num_coeffs];
+                for (int quadrant = 0; quadrant < 4; quadrant++) {
+                    int q_x = quadrant % 2;
+                    int q_y = quadrant / 2;
+                    int child_cell = (2 * (cell / level.dim) + q_y) * child.dim + 2 * (cell % level.dim) + q_x;
+                    if (child.count[child_cell] == 0) {
+                        continue;
+                    }
+
+                    pow_x[0] = pow_y[0] = 1.0;
+                    for (int p = 1; p <= order; p++) {
+                        pow_x[p] = pow_x[p - 1] * (0.5 - q_x) * child.width;
+                        pow_y[p] = pow_y[p - 1] * (0.5 - q_y) * child.width;
+                    }
+
+                    const double* child_multipole = &child.multipoles[child_cell * num_coeffs];
+                    for (int d = 0; d <= order; d++) {
+                        for (int b = 0; b <= d; b++) {
+                            int a = d - b;
+                            double sum = 0;
+                            for (int i = 0; i <= a; i++) {
+                                for (int j = 0; j <= b; j++) {
+                                    sum += Binomial(a, i) * Binomial(b, j) * pow_x[a - i] * pow_y[b - j] * child_multipole[Index(i, j)];
+                                }
+                            }
+                            multipole[Index(a, b)] += sum;
+                        }
+                    }
+                }
+            }
+        });
+    }
+}
+
+void FastMultipole::Downward(ThreadPool& pool) {
+
+    for (int l = 2; l <= depth; l++) {
+        Level& level = levels[l];
+        const Level& parent = levels[l - 1];
+        pool.ParallelFor(0, level.dim * level.dim, [&](int start, int end) {
+            std::vector<double> pow_x(order + 1), pow_y(order + 1);
+            for (int cell = start; cell < end; cell++) {
+                if (level.count[cell] == 0) {
+                    continue;
+                }
+
+                int cell_x = cell % level.dim;
+                int cell_y = cell / level.dim;
+                double* local = &level.locals[cell * num_coeffs];
+
+                // L2L: re-expand the parent's local about this cell, s = child - parent
+                if (l > 2) {
+                    pow_x[0] = pow_y[0] = 1.0;
+                    for (int p = 1; p <= order; p++) {
+                        pow_x[p] = pow_x[p - 1] * ((cell_x % 2) - 0.5) * level.width;
+                        pow_y[p] = pow_y[p - 1] * ((cell_y % 2) - 0.5) * level.width;
+                    }
+
+                    const double* parent_local = &parent.locals[((cell_y / 2) * parent.dim + cell_x / 2) * num_coeffs];
+                    for (int d = 0; d <= order; d++) {
+                        for (int b = 0; b <= d; b++) {
+                            int a = d - b;
+                            double sum = 0;
+                            for (int i = a; i <= order; i++) {
+                                for (int j = b; i + j <= order; j++) {
+                                    sum += Binomial(i, a) * Binomial(j, b) * pow_x[i - a] * pow_y[j - b] * parent_local[Index(i, j)];
+                                }
+                            }
+                            local[Index(a, b)] += sum;
+                        }
+                    }
+                }
+
+                // M2L: children of the parent's neighbours that aren't neighbours of this cell
+                int first_x = std::max(0, 2 * (cell_x / 2 - 1));
+                int first_y = std::max(0, 2 * (cell_y / 2 - 1));
+                int last_x = std::min(level.dim - 1, 2 * (cell_x / 2 + 1) + 1);
+                int last_y = std::min(level.dim - 1, 2 * (cell_y / 2 + 1) + 1);
+                for (int source_y = first_y; source_y <= last_y; source_y++) {
+                    for (int source_x = first_x; source_x <= last_x; source_x++) {
+                        int d_x = cell_x - source_x;
+                        int d_y = cell_y - source_y;
+                        int source = source_y * level.dim + source_x;
+                        if ((std::abs(d_x) <= 1 && std::abs(d_y) <= 1) || level.count[source] == 0) {
+                            continue;
+                        }
+
+                        const double* multipole = &level.multipoles[source * num_coeffs];
+                        const double* derivatives = &level.m2l[((d_y + 3) * 7 + d_x + 3) * num_coeffs];
+                        for (int c = 0; c < num_coeffs; c++) {
+                            double sum = 0;
+                            for (int t = m2l_start[c]; t < m2l_start[c + 1]; t++) {
+                                sum += m2l_terms[t].weight * multipole[m2l_terms[t].multipole] * derivatives[m2l_terms[t].derivative];
+                            }
+                            local[c] += sum;
+                        }
+                    }
+                }
+            }
+        });
+    }
+}
+
+void FastMultipole::Evaluate(float* out_x, float* out_y, ThreadPool& pool) {
+
+    const Level& leaves = levels[depth];
+    int dim = leaves.dim;
+    int n = sorted.size();
+
+    pool.ParallelFor(0, dim * dim, [&](int start, int end) {
+        std::vector<double> pow_x(order + 1), pow_y(order + 1);
+        for (int cell = start; cell < end; cell++) {
+            if (leaves.count[cell] == 0) {
+                continue;
+            }
+
+            int cell_x = cell % dim;
+            int cell_y = cell / dim;
+            double center_x = root_x + (cell_x + 0.5) * leaves.width;
+            double center_y = root_y + (cell_y + 0.5) * leaves.width;
+            const double* local = &leaves.locals[cell * num_coeffs];
+
+            for (int k = leaf_start[cell]; k < leaf_start[cell + 1]; k++) {
+                // L2P: a = G grad(sum L_n y^n), y relative to the leaf center
+                double far_x = 0;
+                double far_y = 0;
+                if (depth >= 2) {
+                    pow_x[0] = pow_y[0] = 1.0;
+                    for (int p = 1; p <= order; p++) {
+                        pow_x[p] = pow_x[p - 1] * (sorted_x[k] - center_x);
+                        pow_y[p] = pow_y[p - 1] * (sorted_y[k] - center_y);
+                    }
+                    for (int d = 1; d <= order; d++) {
+                        for (int b = 0; b <= d; b++) {
+                            int a = d - b;
+                            if (a > 0) far_x += local[Index(a, b)] * a * pow_x[a - 1] * pow_y[b];
+                            if (b > 0) far_y += local[Index(a, b)] * b * pow_x[a] * pow_y[b - 1];
+                        }
+                    }
+                }
+
+                // P2P over the 3x3 neighbouring leaves, the three leaves of a row
+                // are contiguous in leaf order
+                float near_x = 0.0f;
+                float near_y = 0.0f;
+                for (int n_y = std::max(0, cell_y - 1); n_y <= std::min(dim - 1, cell_y + 1); n_y++) {
+                    int row_start = leaf_start[n_y * dim + std::max(0, cell_x - 1)];
+                    int row_end = leaf_start[n_y * dim + std::min(dim - 1, cell_x + 1) + 1];
+                    SumRowSimd(sorted_x.data(), sorted_y.data(), sorted_mass.data(), sorted_radius.data(), row_start, row_end, 
+                        sorted_x[k], sorted_y[k], sorted_radius[k], near_x, near_y, simd_level);
+                }
+                SumRowSimd(sorted_x.data(), sorted_y.data(), sorted_mass.data(), sorted_radius.data(), num_inside, n, 
+                    sorted_x[k], sorted_y[k], sorted_radius[k], near_x, near_y, simd_level);
+
+                out_x[sorted[k]] = G * (far_x + near_x);
+                out_y[sorted[k]] = G * (far_y + near_y);
+            }
+        }
+    });
+
+    // the particles outside the root feel everyone directly
+    pool.ParallelFor(num_inside, n, [&](int start, int end) {
+        for (int k = start; k < end; k++) {
+            float sum_x = 0.0f;
+            float sum_y = 0.0f;
+            SumRowSimd(sorted_x.data(), sorted_y.data(), sorted_mass.data(), sorted_radius.data(), 0, n, 
+                sorted_x[k], sorted_y[k], sorted_radius[k], sum_x, sum_y, simd_level);
+            out_x[sorted[k]] = G * sum_x;
+            out_y[sorted[k]] = G * sum_y;
+        }
+    });
+}
+
+void FastMultipole::CalcAccels(ParticleSystem& particles, ThreadPool& pool) {
+
+    if (particles.Size() == 0) {
+        return;
+    }
+
+    BuildTree(particles, pool);
+    Upward(pool);
+    Downward(pool);
+    Evaluate(particles.ax.data(), particles.ay.data(), pool);
+}
+
+void FastMultipole::CalcActiveAccels(ParticleSystem& particles, const std::vector<int>& active, ThreadPool& pool) {
+
+    if (particles.Size() == 0) {
+        return;
+    }
+
+    // the expansions cost the same for any number of targets, so evaluate
+    // everyone and keep the accelerations of the active particles
+    accel_x.resize(particles.Size());
+    accel_y.resize(particles.Size());
+
+    BuildTree(particles, pool);
+    Upward(pool);
+    Downward(pool);
+    Evaluate(accel_x.data(), accel_y.data(), pool);
+
+    for (int i : active) {
+        particles.ax[i] = accel_x[i];
+        particles.ay[i] = accel_y[i];
+    }
+}
+
+void FastMultipole::SetOrder(int order) {
+
+    this->order = std::clamp(order, 1, 20);
+    num_coeffs = (this->order + 1) * (this->order + 2) / 2;
+
+    // Pascal's triangle up to 2 * order, M2L needs (k + n choose k)
+    int size = 2 * this->order + 1;
+    binomial.assign(size * size, 0.0);
+    for (int n = 0; n < size; n++) {
+        binomial[n * size] = 1.0;
+        for (int k = 1; k <= n; k++) {
+            binomial[n * size + k] = binomial[(n - 1) * size + k - 1] + binomial[(n - 1) * size + k];
+        }
+    }
+
+    // L_n += (k + n choose k) M_k D_(k + n) for every |k| + |n| <= order,
+    // grouped by n in coefficient order
+    m2l_terms.clear();
+    m2l_start.assign(1, 0);
+    for (int d = 0; d <= this->order; d++) {
+        for (int b = 0; b <= d; b++) {
+            int a = d - b;
+            for (int k_d = 0; k_d + d <= this->order; k_d++) {
+                for (int k_b = 0; k_b <= k_d; k_b++) {
+                    int k_a = k_d - k_b;
+                    m2l_terms.push_back({Index(k_a, k_b), Index(k_a + a, k_b + b), Binomial(k_a + a, k_a) * Binomial(k_b + b, k_b)});
+                }
+            }
+            m2l_start.push_back(m2l_terms.size());
+        }
+    }
+}
+
+int FastMultipole::GetOrder() const {
+    return order;
+}
+
+void FastMultipole::SetLeafSize(int leaf_size) {
+    this->leaf_size = std::max(1, leaf_size);
+}
+
+int FastMultipole::GetLeafSize() const {
+    return leaf_size;
+}
+
+void FastMultipole::SetSimdLevel(SimdLevel simd_level) {
+    this->simd_level = simd_level;
+}
+
+SimdLevel FastMultipole::GetSimdLevel() const {
+    return simd_level;
+}
+
+int FastMultipole::GetDepth() const {
+    return depth;
+}
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "frame_capture.hpp"
+
+#include <csignal>
+#include <cstring>
+#include <format>
+
+#include <raylib.h>
+#include <rlgl.h>
+
+FrameCapture::FrameCapture(int width, int height, int fps, const std::string& output, int ring_size) :
+    width(width),
+    height(height),
+    encoder(nullptr),
+    failed(false),
+    finishing(false) {
+
+    std::string ffmpeg_cmd = std::format(
+        "ffmpeg -y -loglevel error -f rawvideo -pixel_format rgba -video_size {}x{} -framerate {} -i - "
+        "-c:v libx264 -r {} -pix_fmt yuv420p {}",
+        width, height, fps, fps, output);
+
+    // if ffmpeg dies, report a failed write instead of being killed by SIGPIPE
+    std::signal(SIGPIPE, SIG_IGN);
+
+    encoder = popen(ffmpeg_cmd.c_str(), "w");
+    if (!encoder) {
+        return;
+    }
+
+    // every buffer is allocated up front and reused for the whole run
+    ring.resize(ring_size);
+    for (int i = 0; i < ring_size; i++) {
+        ring[i].resize(static_cast<std::size_t>(width) * height * 4);
+        free_slots.push_back(i);
+    }
+
+    writer = std::thread(&FrameCapture::WriterLoop, this);
+}
+
+FrameCapture::~FrameCapture() {
+    Finish();
+}
+
+void FrameCapture::WriterLoop() {
+
+    while (true) {
+        int slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            slot_filled.wait(lock, [&] { return finishing || !filled_slots.empty(); });
+            if (filled_slots.empty()) {
+                return;
+            }
+            slot = filled_slots.front();
+            filled_slots.pop_front();
+        }
+
+        // the pipe write blocks while ffmpeg is busy encoding, off the render thread
+        const std::vector<unsigned char>& frame = ring[slot];
+        if (!failed && std::fwrite(frame.data(), 1, frame.size(), encoder) != frame.size()) {
+            failed = true;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_slots.push_back(slot);
+        }
+        slot_freed.notify_one();
+    }
+}
+
+bool FrameCapture::IsOpen() const {
+    return encoder != nullptr;
+}
+
+void FrameCapture::Capture() {
+
+    if (!encoder) {
+        return;
+    }
+
+    int slot;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        slot_freed.wait(lock, [&] { return !free_slots.empty(); });
+        slot = free_slots.front();
+        free_slots.pop_front();
+    }
+
+    // make sure everything drawn so far has reached the framebuffer
+    rlDrawRenderBatchActive();
+
+    // rlReadScreenPixels already flips the image the right way up
+    unsigned char* pixels = rlReadScreenPixels(width, height);
+    std::memcpy(ring[slot].data(), pixels, ring[slot].size());
+    MemFree(pixels);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        filled_slots.push_back(slot);
+    }
+    slot_filled.notify_one();
+}
+
+bool FrameCapture::Finish() {
+
+    if (!encoder) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finishing = true;
+    }
+    slot_filled.notify_one();
+    writer.join();
+
+    int result = pclose(encoder);
+    encoder = nullptr;
+
+    return !failed && result == 0;
+}
\ No newline at end of file
@@ -0,0 +1,428 @@
+#include "gravity_kernel.hpp"
+#include "gravity.hpp"
+
+#include <immintrin.h>
+
+// The kernels below are compiled for their own instruction set with target
+// attributes, so the rest of the binary stays baseline x86-64 and the level
+// is picked at runtime.
+
+// cutoff: the pair only counts when size_i + size_j <= distance / 20,
+// i.e. distance^2 >= 400 (size_i + size_j)^2 (this also drops i == j)
+
+static void CalcAccelsScalar(const ParticleSystem& particles, float* accel_x, float* accel_y, const int* indices, int start, int end) {
+
+    int n = particles.Size();
+    const float* x = particles.x.data();
+    const float* y = particles.y.data();
+    const float* mass = particles.mass.data();
+    const float* radius = particles.radius.data();
+
+    for (int k = start; k < end; k++) {
+        int i = indices ? indices[k] : k;
+        float sum_x = 0.0f;
+        float sum_y = 0.0f;
+        for (int j = 0; j < n; j++) {
+            float d_x = x[j] - x[i];
+            float d_y = y[j] - y[i];
+            float distance_squared = d_x * d_x + d_y * d_y;
+            float size_sum = radius[i] + radius[j];
+            if (distance_squared < 400.0f * size_sum * size_sum || distance_squared == 0.0f) {
+                continue;
+            }
+            float inv_distance = 1.0f / std::sqrt(distance_squared);
+            float factor = mass[j] * inv_distance * inv_distance * inv_distance;
+            sum_x += factor * d_x;
+            sum_y += factor * d_y;
+        }
+        accel_x[i] = sum_x * G;
+        accel_y[i] = sum_y * G;
+    }
+}
+
+// remainder of a row that doesn't fill a whole vector
+static inline void CalcRowTail(const ParticleSystem& particles, int i, int j_start, float& sum_x, float& sum_y) {
+
+    int n = particles.Size();
+    for (int j = j_start; j < n; j++) {
+        float d_x = particles.x[j] - particles.x[i];
+        float d_y = particles.y[j] - particles.y[i];
+        float distance_squared = d_x * d_x + d_y * d_y;
+        float size_sum = particles.radius[i] + particles.radius[j];
+        if (distance_squared < 400.0f * size_sum * size_sum || distance_squared == 0.0f) {
+            continue;
+        }
+        float inv_distance = 1.0f / std::sqrt(distance_squared);
+        float factor = particles.mass[j] * inv_distance * inv_distance * inv_distance;
+        sum_x += factor * d_x;
+        sum_y += factor * d_y;
+    }
+}
+
+__attribute__((target("sse2")))
+static void CalcAccelsSSE2(const ParticleSystem& particles, float* accel_x, float* accel_y, const int* indices, int start, int end) {
+
+    int n = particles.Size();
+    int n_vec = n - n % 4;
+    const float* x = particles.x.data();
+    const float* y = particles.y.data();
+    const float* mass = particles.mass.data();
+    const float* radius = particles.radius.data();
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three_halves = _mm_set1_ps(1.5f);
+    const __m128 cutoff = _mm_set1_ps(400.0f);
+
+    for (int k = start; k < end; k++) {
+        int i = indices ? indices[k] : k;
+        __m128 x_i = _mm_set1_ps(x[i]);
+        __m128 y_i = _mm_set1_ps(y[i]);
+        __m128 r_i = _mm_set1_ps(radius[i]);
+        __m128 sum_x = zero;
+        __m128 sum_y = zero;
+
+        for (int j = 0; j < n_vec; j += 4) {
+            __m128 d_x = _mm_sub_ps(_mm_load_ps(x + j), x_i);
+            __m128 d_y = _mm_sub_ps(_mm_load_ps(y + j), y_i);
+            __m128 distance_squared = _mm_add_ps(_mm_mul_ps(d_x, d_x), _mm_mul_ps(d_y, d_y));
+            __m128 size_sum = _mm_add_ps(_mm_load_ps(radius + j), r_i);
+            __m128 mask = _mm_and_ps(
+                _mm_cmpge_ps(distance_squared, _mm_mul_ps(cutoff, _mm_mul_ps(size_sum, size_sum))),
+                _mm_cmpgt_ps(distance_squared, zero));
+
+            // rsqrt is ~12 bits, one Newton step brings it to ~23
+            __m128 inv = _mm_rsqrt_ps(distance_squared);
+            inv = _mm_mul_ps(inv, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, distance_squared), _mm_mul_ps(inv, inv))));
+
+            __m128 factor = _mm_mul_ps(_mm_load_ps(mass + j), _mm_mul_ps(inv, _mm_mul_ps(inv, inv)));
+            factor = _mm_and_ps(mask, factor);
+            sum_x = _mm_add_ps(sum_x, _mm_mul_ps(factor, d_x));
+            sum_y = _mm_add_ps(sum_y, _mm_mul_ps(factor, d_y));
+        }
+
+        alignas(16) float lanes_x[4];
+        alignas(16) float lanes_y[4];
+        _mm_store_ps(lanes_x, sum_x);
+        _mm_store_ps(lanes_y, sum_y);
+        float total_x = (lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]);
+        float total_y = (lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]);
+        CalcRowTail(particles, i, n_vec, total_x, total_y);
+
+        accel_x[i] = total_x * G;
+        accel_y[i] = total_y * G;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void CalcAccelsAVX2(const ParticleSystem& particles, float* accel_x, float* accel_y, const int* indices, int start, int end) {
+
+    int n = particles.Size();
+    int n_vec = n - n % 8;
+    const float* x = particles.x.data();
+    const float* y = particles.y.data();
+    const float* mass = particles.mass.data();
+    const float* radius = particles.radius.data();
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 cutoff = _mm256_set1_ps(400.0f);
+
+    for (int k = start; k < end; k++) {
+        int i = indices ? indices[k] : k;
+        __m256 x_i = _mm256_set1_ps(x[i]);
+        __m256 y_i = _mm256_set1_ps(y[i]);
+        __m256 r_i = _mm256_set1_ps(radius[i]);
+        __m256 sum_x = zero;
+        __m256 sum_y = zero;
+
+        for (int j = 0; j < n_vec; j += 8) {
+            __m256 d_x = _mm256_sub_ps(_mm256_load_ps(x + j), x_i);
+            __m256 d_y = _mm256_sub_ps(_mm256_load_ps(y + j), y_i);
+            __m256 distance_squared = _mm256_fmadd_ps(d_y, d_y, _mm256_mul_ps(d_x, d_x));
+            __m256 size_sum = _mm256_add_ps(_mm256_load_ps(radius + j), r_i);
+            __m256 mask = _mm256_and_ps(
+                _mm256_cmp_ps(distance_squared, _mm256_mul_ps(cutoff, _mm256_mul_ps(size_sum, size_sum)), _CMP_GE_OQ),
+                _mm256_cmp_ps(distance_squared, zero, _CMP_GT_OQ));
+
+            __m256 inv = _mm256_rsqrt_ps(distance_squared);
+            inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, distance_squared), _mm256_mul_ps(inv, inv), three_halves));
+
+            __m256 factor = _mm256_mul_ps(_mm256_load_ps(mass + j), _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+            factor = _mm256_and_ps(mask, factor);
+            sum_x = _mm256_fmadd_ps(factor, d_x, sum_x);
+            sum_y = _mm256_fmadd_ps(factor, d_y, sum_y);
+        }
+
+        alignas(32) float lanes_x[8];
+        alignas(32) float lanes_y[8];
+        _mm256_store_ps(lanes_x, sum_x);
+        _mm256_store_ps(lanes_y, sum_y);
+        float total_x = 0.0f;
+        float total_y = 0.0f;
+        for (int lane = 0; lane < 8; lane++) {
+            total_x += lanes_x[lane];
+            total_y += lanes_y[lane];
+        }
+        CalcRowTail(particles, i, n_vec, total_x, total_y);
+
+        accel_x[i] = total_x * G;
+        accel_y[i] = total_y * G;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void CalcAccelsAVX512(const ParticleSystem& particles, float* accel_x, float* accel_y, const int* indices, int start, int end) {
+
+    int n = particles.Size();
+    int n_vec = n - n % 16;
+    const float* x = particles.x.data();
+    const float* y = particles.y.data();
+    const float* mass = particles.mass.data();
+    const float* radius = particles.radius.data();
+
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    const __m512 cutoff = _mm512_set1_ps(400.0f);
+
+    for (int k = start; k < end; k++) {
+        int i = indices ? indices[k] : k;
+        __m512 x_i = _mm512_set1_ps(x[i]);
+        __m512 y_i = _mm512_set1_ps(y[i]);
+        __m512 r_i = _mm512_set1_ps(radius[i]);
+        __m512 sum_x = zero;
+        __m512 sum_y = zero;
+
+        for (int j = 0; j < n_vec; j += 16) {
+            __m512 d_x = _mm512_sub_ps(_mm512_load_ps(x + j), x_i);
+            __m512 d_y = _mm512_sub_ps(_mm512_load_ps(y + j), y_i);
+            __m512 distance_squared = _mm512_fmadd_ps(d_y, d_y, _mm512_mul_ps(d_x, d_x));
+            __m512 size_sum = _mm512_add_ps(_mm512_load_ps(radius + j), r_i);
+            __mmask16 mask = 
+                _mm512_cmp_ps_mask(distance_squared, _mm512_mul_ps(cutoff, _mm512_mul_ps(size_sum, size_sum)), _CMP_GE_OQ) &
+                _mm512_cmp_ps_mask(distance_squared, zero, _CMP_GT_OQ);
+
+            // rsqrt14 is ~14 bits, one Newton step brings it to full float precision
+            __m512 inv = _mm512_rsqrt14_ps(distance_squared);
+            inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(half, distance_squared), _mm512_mul_ps(inv, inv), three_halves));
+
+            __m512 factor = _mm512_maskz_mul_ps(mask, _mm512_load_ps(mass + j), _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv)));
+            sum_x = _mm512_fmadd_ps(factor, d_x, sum_x);
+            sum_y = _mm512_fmadd_ps(factor, d_y, sum_y);
+        }
+
+        float total_x = _mm512_reduce_add_ps(sum_x);
+        float total_y = _mm512_reduce_add_ps(sum_y);
+        CalcRowTail(particles, i, n_vec, total_x, total_y);
+
+        accel_x[i] = total_x * G;
+        accel_y[i] = total_y * G;
+    }
+}
+
+// Row sums over a range of plain arrays (no alignment needed), for callers
+// that keep their own copy of the particles such as the multipole solver.
+
+static void SumRowScalar(const float* x, const float* y, const float* mass, const float* radius, int start, int end, 
+    float x_i, float y_i, float radius_i, float& sum_x, float& sum_y) {
+
+    for (int j = start; j < end; j++) {
+        float d_x = x[j] - x_i;
+        float d_y = y[j] - y_i;
+        float distance_squared = d_x * d_x + d_y * d_y;
+        float size_sum = radius_i + radius[j];
+        if (distance_squared < 400.0f * size_sum * size_sum || distance_squared == 0.0f) {
+            continue;
+        }
+        float inv_distance = 1.0f / std::sqrt(distance_squared);
+        float factor = mass[j] * inv_distance * inv_distance * inv_distance;
+        sum_x += factor * d_x;
+        sum_y += factor * d_y;
+    }
+}
+
+__attribute__((target("sse2")))
+static void SumRowSSE2(const float* x, const float* y, const float* mass, const float* radius, int start, int end, 
+    float x_i, float y_i, float radius_i, float& sum_x, float& sum_y) {
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three_halves = _mm_set1_ps(1.5f);
+    const __m128 cutoff = _mm_set1_ps(400.0f);
+    __m128 vx_i = _mm_set1_ps(x_i);
+    __m128 vy_i = _mm_set1_ps(y_i);
+    __m128 r_i = _mm_set1_ps(radius_i);
+    __m128 vsum_x = zero;
+    __m128 vsum_y = zero;
+
+    int j = start;
+    for (; j + 4 <= end; j += 4) {
+        __m128 d_x = _mm_sub_ps(_mm_loadu_ps(x + j), vx_i);
+        __m128 d_y = _mm_sub_ps(_mm_loadu_ps(y + j), vy_i);
+        __m128 distance_squared = _mm_add_ps(_mm_mul_ps(d_x, d_x), _mm_mul_ps(d_y, d_y));
+        __m128 size_sum = _mm_add_ps(_mm_loadu_ps(radius + j), r_i);
+        __m128 mask = _mm_and_ps(
+            _mm_cmpge_ps(distance_squared, _mm_mul_ps(cutoff, _mm_mul_ps(size_sum, size_sum))),
+            _mm_cmpgt_ps(distance_squared, zero));
+
+        __m128 inv = _mm_rsqrt_ps(distance_squared);
+        inv = _mm_mul_ps(inv, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, distance_squared), _mm_mul_ps(inv, inv))));
+
+        __m128 factor = _mm_and_ps(mask, _mm_mul_ps(_mm_loadu_ps(mass + j), _mm_mul_ps(inv, _mm_mul_ps(inv, inv))));
+        vsum_x = _mm_add_ps(vsum_x, _mm_mul_ps(factor, d_x));
+        vsum_y = _mm_add_ps(vsum_y, _mm_mul_ps(factor, d_y));
+    }
+
+    alignas(16) float lanes_x[4];
+    alignas(16) float lanes_y[4];
+    _mm_store_ps(lanes_x, vsum_x);
+    _mm_store_ps(lanes_y, vsum_y);
+    sum_x += (lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]);
+    sum_y += (lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]);
+    SumRowScalar(x, y, mass, radius, j, end, x_i, y_i, radius_i, sum_x, sum_y);
+}
+
+__attribute__((target("avx2,fma")))
+static void SumRowAVX2(const float* x, const float* y, const float* mass, const float* radius, int start, int end, 
+    float x_i, float y_i, float radius_i, float& sum_x, float& sum_y) {
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 cutoff = _mm256_set1_ps(400.0f);
+    __m256 vx_i = _mm256_set1_ps(x_i);
+    __m256 vy_i = _mm256_set1_ps(y_i);
+    __m256 r_i = _mm256_set1_ps(radius_i);
+    __m256 vsum_x = zero;
+    __m256 vsum_y = zero;
+
+    int j = start;
+    for (; j + 8 <= end; j += 8) {
+        __m256 d_x = _mm256_sub_ps(_mm256_loadu_ps(x + j), vx_i);
+        __m256 d_y = _mm256_sub_ps(_mm256_loadu_ps(y + j), vy_i);
+        __m256 distance_squared = _mm256_fmadd_ps(d_y, d_y, _mm256_mul_ps(d_x, d_x));
+        __m256 size_sum = _mm256_add_ps(_mm256_loadu_ps(radius + j), r_i);
+        __m256 mask = _mm256_and_ps(
+            _mm256_cmp_ps(distance_squared, _mm256_mul_ps(cutoff, _mm256_mul_ps(size_sum, size_sum)), _CMP_GE_OQ),
+            _mm256_cmp_ps(distance_squared, zero, _CMP_GT_OQ));
+
+        __m256 inv = _mm256_rsqrt_ps(distance_squared);
+        inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, distance_squared), _mm256_mul_ps(inv, inv), three_halves));
+
+        __m256 factor = _mm256_and_ps(mask, _mm256_mul_ps(_mm256_loadu_ps(mass + j), _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv))));
+        vsum_x = _mm256_fmadd_ps(factor, d_x, vsum_x);
+        vsum_y = _mm256_fmadd_ps(factor, d_y, vsum_y);
+    }
+
+    alignas(32) float lanes_x[8];
+    alignas(32) float lanes_y[8];
+    _mm256_store_ps(lanes_x, vsum_x);
+    _mm256_store_ps(lanes_y, vsum_y);
+    for (int lane = 0; lane < 8; lane++) {
+        sum_x += lanes_x[lane];
+        sum_y += lanes_y[lane];
+    }
+    SumRowScalar(x, y, mass, radius, j, end, x_i, y_i, radius_i, sum_x, sum_y);
+}
+
+__attribute__((target("avx512f")))
+static void SumRowAVX512(const float* x, const float* y, const float* mass, const float* radius, int start, int end, 
+    float x_i, float y_i, float radius_i, float& sum_x, float& sum_y) {
+
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    const __m512 cutoff = _mm512_set1_ps(400.0f);
+    __m512 vx_i = _mm512_set1_ps(x_i);
+    __m512 vy_i = _mm512_set1_ps(y_i);
+    __m512 r_i = _mm512_set1_ps(radius_i);
+    __m512 vsum_x = zero;
+    __m512 vsum_y = zero;
+
+    // the remainder is a masked load instead of a scalar tail
+    for (int j = start; j < end; j += 16) {
+        __mmask16 in_range = (end - j >= 16) ? 0xFFFF : static_cast<__mmask16>((1u << (end - j)) - 1);
+        __m512 d_x = _mm512_sub_ps(_mm512_maskz_loadu_ps(in_range, x + j), vx_i);
+        __m512 d_y = _mm512_sub_ps(_mm512_maskz_loadu_ps(in_range, y + j), vy_i);
+        __m512 distance_squared = _mm512_fmadd_ps(d_y, d_y, _mm512_mul_ps(d_x, d_x));
+        __m512 size_sum = _mm512_add_ps(_mm512_maskz_loadu_ps(in_range, radius + j), r_i);
+        __mmask16 mask = in_range &
+            _mm512_cmp_ps_mask(distance_squared, _mm512_mul_ps(cutoff, _mm512_mul_ps(size_sum, size_sum)), _CMP_GE_OQ) &
+            _mm512_cmp_ps_mask(distance_squared, zero, _CMP_GT_OQ);
+
+        __m512 inv = _mm512_rsqrt14_ps(distance_squared);
+        inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(half, distance_squared), _mm512_mul_ps(inv, inv), three_halves));
+
+        __m512 factor = _mm512_maskz_mul_ps(mask, _mm512_maskz_loadu_ps(in_range, mass + j), _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv)));
+        vsum_x = _mm512_fmadd_ps(factor, d_x, vsum_x);
+        vsum_y = _mm512_fmadd_ps(factor, d_y, vsum_y);
+    }
+
+    sum_x += _mm512_reduce_add_ps(vsum_x);
+    sum_y += _mm512_reduce_add_ps(vsum_y);
+}
+
+SimdLevel DetectSimdLevel() {
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SimdLevel::SSE2;
+    }
+    return SimdLevel::Scalar;
+}
+
+const char* SimdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::SSE2: return "SSE2";
+        case SimdLevel::AVX2: return "AVX2";
+        case SimdLevel::AVX512: return "AVX-512";
+        default: return "scalar";
+    }
+}
+
+void CalcAccelsSimd(const ParticleSystem& particles, float* accel_x, float* accel_y, int start, int end, SimdLevel level) {
+    CalcAccelsSimd(particles, accel_x, accel_y, nullptr, start, end, level);
+}
+
+void CalcAccelsSimd(const ParticleSystem& particles, float* accel_x, float* accel_y, const int* indices, int start, int end, SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512:
+            CalcAccelsAVX512(particles, accel_x, accel_y, indices, start, end);
+            break;
+        case SimdLevel::AVX2:
+            CalcAccelsAVX2(particles, accel_x, accel_y, indices, start, end);
+            break;
+        case SimdLevel::SSE2:
+            CalcAccelsSSE2(particles, accel_x, accel_y, indices, start, end);
+            break;
+        default:
+            CalcAccelsScalar(particles, accel_x, accel_y, indices, start, end);
+            break;
+    }
+}
+
+void SumRowSimd(const float* x, const float* y, const float* mass, const float* radius, int start, int end, 
+    float x_i, float y_i, float radius_i, float& sum_x, float& sum_y, SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512:
+            SumRowAVX512(x, y, mass, radius, start, end, x_i, y_i, radius_i, sum_x, sum_y);
+            break;
+        case SimdLevel::AVX2:
+            SumRowAVX2(x, y, mass, radius, start, end, x_i, y_i, radius_i, sum_x, sum_y);
+            break;
+        case SimdLevel::SSE2:
+            SumRowSSE2(x, y, mass, radius, start, end, x_i, y_i, radius_i, sum_x, sum_y);
+            break;
+        default:
+            SumRowScalar(x, y, mass, radius, start, end, x_i, y_i, radius_i, sum_x, sum_y);
+            break;
+    }
+}
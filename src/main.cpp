@@ -1,40 +1,264 @@
 #include <iostream>
+#include <fstream>
 #include <cmath>
 #include <random>
 #include <filesystem>
 #include <format>
 #include <thread>
+#include <string>
+#include <algorithm>
 #include <raylib-cpp.hpp>
 
 #include "quad_tree.hpp"
-#include "particle.hpp"
+#include "particle_renderer.hpp"
+#include "particle_system.hpp"
+#include "simulation.hpp"
+#include "direct_sum.hpp"
+#include "gravity_kernel.hpp"
+#include "frame_capture.hpp"
+#include "simulation_thread.hpp"
 
-void mt_CalcParticleAccels(std::vector<Particle>& particles, double dt, int start, int end) {
-    for (int i = start; i < end; i++) {
-        Particle& p_i = particles[i];
-        for (int j = i + 1; j < particles.size(); j++) {
-            Particle& p_j = particles[j];
-            p_i.CalcAccel(p_j, dt);
+int screen_w = 2*800;
+int screen_h = 2*450;
+
+raylib::Color text_colour = raylib::Color::White();
+
+raylib::Color background(0, 0, 10, 0);
+
+double sim_speed = 0.25;
+int target_fps = 60;
+
+struct Options {
+    bool headless = false;
+    int steps = 4*600;         // headless: number of steps to run
+    int stats_every = 1;       // headless: steps between lines of stats.csv (0 = never)
+    int snapshot_every = 0;    // headless: steps between particle snapshots (0 = never)
+    std::string output = "output"; // headless: directory for stats and snapshots
+    ForceSolver solver = ForceSolver::Exact;
+    double theta = 0.5;
+    double tree_rebuild = 0.1;  // Barnes-Hut: fraction of particles changing leaf above which the tree is rebuilt
+    int leaf_size = 16;         // Barnes-Hut: particles a leaf holds before it splits
+    int tree_depth = 16;        // Barnes-Hut: levels below which leaves never split
+    int reorder = 8;            // steps between Morton order checks (0 = never reorder)
+    bool adaptive_reorder = true; // the reorder interval follows the measured disorder
+    int fmm_order = 6;
+    int grid = 256;            // particle-mesh grid size
+    bool periodic = false;     // wrap around the boundary instead of letting particles leave it
+    bool instanced = true;     // one instanced draw call for all particles, DrawCircleLines per particle otherwise
+    bool density_lod = true;   // density texture instead of circles once particles are under a pixel
+    Integrator integrator = Integrator::Euler;
+    double dt = sim_speed / target_fps;
+    int block_levels = 0;      // power-of-two timestep levels below dt (0 = one global dt)
+    double eta = 0.05;         // block timestep accuracy
+    bool energy = false;       // headless: add potential and total energy to stats.csv (O(N^2) per line)
+    int threads = std::thread::hardware_concurrency();
+    unsigned seed = std::random_device()();
+};
+
+void PrintUsage() {
+    std::cout << 
+        "usage: main [--headless] [--steps N] [--stats-every N] [--snapshot-every N]\n"
+        "            [--output DIR] [--solver exact|barnes-hut|fmm|pm] [--theta T] [--fmm-order P]\n"
+        "            [--tree-rebuild F] [--leaf-size N] [--tree-depth D]\n"
+        "            [--reorder K] [--fixed-reorder]\n"
+        "            [--grid M] [--periodic] [--renderer instanced|lines] [--no-lod]\n"
+        "            [--integrator euler|leapfrog|verlet] [--dt DT] [--energy]\n"
+        "            [--block-levels N] [--eta E]\n"
+        "            [--threads N] [--seed S]\n";
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--headless") {
+            options.headless = true;
+        }
+        else if (arg == "--steps" && has_value) {
+            options.steps = std::stoi(argv[++i]);
+        }
+        else if (arg == "--stats-every" && has_value) {
+            options.stats_every = std::stoi(argv[++i]);
+        }
+        else if (arg == "--snapshot-every" && has_value) {
+            options.snapshot_every = std::stoi(argv[++i]);
+        }
+        else if (arg == "--output" && has_value) {
+            options.output = argv[++i];
+        }
+        else if (arg == "--solver" && has_value) {
+            std::string solver = argv[++i];
+            if (solver == "exact") {
+                options.solver = ForceSolver::Exact;
+            }
+            else if (solver == "barnes-hut") {
+                options.solver = ForceSolver::BarnesHut;
+            }
+            else if (solver == "fmm") {
+                options.solver = ForceSolver::FastMultipole;
+            }
+            else if (solver == "pm") {
+                options.solver = ForceSolver::ParticleMesh;
+            }
+            else {
+                std::cerr << "Unknown solver: " << solver << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--theta" && has_value) {
+            options.theta = std::stod(argv[++i]);
+        }
+        else if (arg == "--tree-rebuild" && has_value) {
+            options.tree_rebuild = std::stod(argv[++i]);
+        }
+        else if (arg == "--leaf-size" && has_value) {
+            options.leaf_size = std::stoi(argv[++i]);
+        }
+        else if (arg == "--tree-depth" && has_value) {
+            options.tree_depth = std::stoi(argv[++i]);
+        }
+        else if (arg == "--reorder" && has_value) {
+            options.reorder = std::stoi(argv[++i]);
+        }
+        else if (arg == "--fixed-reorder") {
+            options.adaptive_reorder = false;
+        }
+        else if (arg == "--fmm-order" && has_value) {
+            options.fmm_order = std::stoi(argv[++i]);
+        }
+        else if (arg == "--grid" && has_value) {
+            options.grid = std::stoi(argv[++i]);
+        }
+        else if (arg == "--periodic") {
+            options.periodic = true;
+        }
+        else if (arg == "--no-lod") {
+            options.density_lod = false;
+        }
+        else if (arg == "--renderer" && has_value) {
+            std::string renderer = argv[++i];
+            if (renderer == "instanced" || renderer == "lines") {
+                options.instanced = (renderer == "instanced");
+            }
+            else {
+                std::cerr << "Unknown renderer: " << renderer << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--integrator" && has_value) {
+            std::string integrator = argv[++i];
+            if (integrator == "euler") {
+                options.integrator = Integrator::Euler;
+            }
+            else if (integrator == "leapfrog") {
+                options.integrator = Integrator::Leapfrog;
+            }
+            else if (integrator == "verlet") {
+                options.integrator = Integrator::VelocityVerlet;
+            }
+            else {
+                std::cerr << "Unknown integrator: " << integrator << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--dt" && has_value) {
+            options.dt = std::stod(argv[++i]);
+        }
+        else if (arg == "--block-levels" && has_value) {
+            options.block_levels = std::stoi(argv[++i]);
+        }
+        else if (arg == "--eta" && has_value) {
+            options.eta = std::stod(argv[++i]);
+        }
+        else if (arg == "--energy") {
+            options.energy = true;
+        }
+        else if (arg == "--threads" && has_value) {
+            options.threads = std::stoi(argv[++i]);
+        }
+        else if (arg == "--seed" && has_value) {
+            options.seed = std::stoul(argv[++i]);
+        }
+        else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return false;
         }
     }
+
+    return true;
 }
 
-void mt_UpdateParticles(std::vector<Particle>& particles, double dt, int start, int end) {
-    for (int i = start; i < end; i++) {
-        particles[i].Update(dt);
-    }
+// the periodic box, 20x the width of the initial camera view, centered on it
+Quad DefaultBoundary() {
+    return Quad(-10 * screen_w, -10 * screen_w, screen_w * 20, screen_w * 20);
 }
 
-int screen_w = 2*800;
-int screen_h = 2*450;
-raylib::Window window(screen_w, screen_h, "raylib [core] example - basic window");
+int RunHeadless(const Options& options) {
+
+    Simulation sim(DefaultBoundary(), options.dt, options.threads, options.seed);
+    sim.SetSolver(options.solver);
+    sim.SetTheta(options.theta);
+    sim.SetTreeRebuildFraction(options.tree_rebuild);
+    sim.SetTreeLeafSize(options.leaf_size);
+    sim.SetTreeMaxDepth(options.tree_depth);
+    sim.SetReorderInterval(options.reorder);
+    sim.SetAdaptiveReorder(options.adaptive_reorder);
+    sim.GetFastMultipole().SetOrder(options.fmm_order);
+    sim.GetParticleMesh().SetGridSize(options.grid);
+    sim.SetPeriodic(options.periodic);
+    sim.SetIntegrator(options.integrator);
+    sim.SetBlockLevels(options.block_levels);
+    sim.SetTimestepAccuracy(options.eta);
+    sim.SpawnSpiral(screen_w / 2, screen_h / 2, 400, 5);
+
+    std::filesystem::create_directories(options.output);
+    std::ofstream stats_file(options.output + "/stats.csv");
+    if (!stats_file) {
+        std::cerr << "Can't write to " << options.output << std::endl;
+        return 1;
+    }
+    stats_file << "step,time,particles,total_mass,kinetic_energy,momentum_x,momentum_y,step_ms,force_evals,tree_moved,tree_rebuilt,disorder,reorder_interval,reordered";
+    stats_file << (options.energy ? ",potential_energy,total_energy\n" : "\n");
+
+    double total_ms = 0;
+    for (int step = 1; step <= options.steps; step++) {
+        sim.Step();
+
+        SimulationStats stats = sim.GetStats();
+        total_ms += stats.step_ms;
+
+        if (options.stats_every > 0 && step % options.stats_every == 0) {
+            stats_file << std::format("{},{},{},{},{},{},{},{},{},{},{},{},{},{}", 
+                stats.step, stats.time, stats.num_particles, stats.total_mass, 
+                stats.kinetic_energy, stats.momentum_x, stats.momentum_y, stats.step_ms, stats.force_evals, 
+                stats.tree_moved, stats.tree_rebuilt ? 1 : 0, stats.disorder, stats.reorder_interval, stats.reordered ? 1 : 0);
+            if (options.energy) {
+                double potential_energy = sim.CalcPotentialEnergy();
+                stats_file << std::format(",{},{}", potential_energy, stats.kinetic_energy + potential_energy);
+            }
+            stats_file << "\n";
+        }
+        if (options.snapshot_every > 0 && step % options.snapshot_every == 0) {
+            std::string filename = std::format("{}/snapshot_{:06d}.csv", options.output, step);
+            if (!sim.WriteSnapshot(filename)) {
+                std::cerr << "Failed to write " << filename << std::endl;
+                return 1;
+            }
+        }
+    }
 
-raylib::Font font("res/fonts/Hack-Regular.ttf", 20);\
-raylib::Color text_colour = raylib::Color::White();
+    std::cout << std::format("{} steps, {} particles left, {:.2f} ms/step", 
+        options.steps, sim.GetParticles().Size(), total_ms / std::max(1, options.steps)) << std::endl;
 
-raylib::Color background(0, 0, 10, 0);
+    return 0;
+}
 
-int main() {
+int RunInteractive(const Options& options) {
+
+    raylib::Window window(screen_w, screen_h, "raylib [core] example - basic window");
+    raylib::Font font("res/fonts/Hack-Regular.ttf", 20);
 
     // SetTargetFPS(60);
 
@@ -45,66 +269,52 @@ int main() {
     cam.rotation = 0.0f;
     cam.zoom = 1.0f;
 
-    Rectangle camera_bounds = {
-        -cam.offset.x / cam.zoom + cam.target.x, 
-        -cam.offset.y / cam.zoom + cam.target.y,
-        screen_w / cam.zoom,
-        screen_h / cam.zoom
-    };
-
-    std::vector<Particle> particle_instances;
+    Simulation sim(DefaultBoundary(), options.dt, options.threads, options.seed);
+    sim.SetSolver(options.solver);
+    sim.SetTheta(options.theta);
+    sim.SetTreeRebuildFraction(options.tree_rebuild);
+    sim.SetTreeLeafSize(options.leaf_size);
+    sim.SetTreeMaxDepth(options.tree_depth);
+    sim.SetReorderInterval(options.reorder);
+    sim.SetAdaptiveReorder(options.adaptive_reorder);
+    sim.GetFastMultipole().SetOrder(options.fmm_order);
+    sim.GetParticleMesh().SetGridSize(options.grid);
+    sim.SetPeriodic(options.periodic);
+    sim.SetIntegrator(options.integrator);
+    sim.SetBlockLevels(options.block_levels);
+    sim.SetTimestepAccuracy(options.eta);
 
     // Spawn particles
-    int square_dim = 400;
-    raylib::Vector2 center = {screen_w / 2, screen_h / 2};
-    for(int i = center.x - square_dim / 2; i < center.x + square_dim / 2; i += 5) {
-        for(int j = center.y - square_dim / 2; j < center.y + square_dim / 2; j += 5) {
-            Particle particle(i, j);
-
-            // assign each particle a random speed
-            {
-                std::random_device rd;
-                std::mt19937 gen(rd()); 
-                std::uniform_real_distribution<double> distribution(-400.0, 400.0);
-                particle.vel.x = distribution(gen) / 10;
-                particle.vel.y = distribution(gen) / 10;    
-            }
-            // assign velocities according to a spiral shape
-            {
-                raylib::Vector2 delta;
-                delta.x = cam.offset.x - particle.pos.x; 
-                delta.y = cam.offset.y - particle.pos.y;
-
-                raylib::Vector2 vel_vector;
-                vel_vector.x = delta.y;
-                vel_vector.y = -1*delta.x;
-                vel_vector.x *= 0.5;
-                vel_vector.y *= 0.5;
-
-                particle.vel += vel_vector;
-            }
+    sim.SpawnSpiral(cam.offset.x, cam.offset.y, 400, 5);
 
-            particle_instances.push_back(particle);
-        }
+    // from here on the simulation belongs to its own thread, the loop below
+    // only draws its snapshots and posts commands to it
+    SimulationThread sim_thread(sim);
+    sim_thread.Start();
+
+    SimdLevel simd_level = DetectSimdLevel(); // used when the exact solver is vectorized
+
+    // falls back to drawing every particle with DrawCircleLines without OpenGL 3.3
+    ParticleRenderer renderer;
+    renderer.SetInstanced(options.instanced);
+    renderer.SetDensityLod(options.density_lod);
+    if (options.instanced && !renderer.IsSupported()) {
+        std::cerr << "Instanced rendering unavailable, drawing particles one by one." << std::endl;
     }
 
-    double sim_speed = 0.25;
+    bool draw_tree = false;
 
     bool isMiddleMouseButtonDown = false;
     raylib::Vector2 lastMousePosition;
 
-    Quad boundary(
-        camera_bounds.x - 10 * camera_bounds.width,
-        camera_bounds.y - 10 * camera_bounds.width,
-        camera_bounds.width * 20,
-        camera_bounds.width * 20);
-
     int frame_count = 0;
+    int target_frame = options.steps;
 
-    int target_fps = 60;
-    int target_frame = 4*600;
-
-    double dt = sim_speed / target_fps; // Set the delta time to be consistent at 60 fps
+    // frames go straight to the encoder, see frame_capture.hpp
+    FrameCapture capture(GetRenderWidth(), GetRenderHeight(), target_fps, "output.mp4");
+    if (!capture.IsOpen()) {
+        std::cerr << "Failed to start ffmpeg, frames won't be recorded." << std::endl;
+    }
 
     while (!window.ShouldClose()) {   // Detect window close button or ESC key
 
@@ -113,61 +323,11 @@ int main() {
 
         // ** Calculations ** //
 
-        // construct new Quad Tree
-        QuadTree quad_tree(boundary, 2);
-
-        // Reset acceleration for all particles to zero at the start of each frame
-        // Add the particles to the quad_tree
-        // Remove particle if outside of quad tree boundary
-        // TODO do the acceleration calcs here or something 
-        for (int i = 0; i < particle_instances.size(); i++) {
-
-            Point particle_point(particle_instances[i].pos.x, particle_instances[i].pos.y);
-            if (!quad_tree.GetBoundary().Contains(particle_point)) {
-                particle_instances.erase(particle_instances.begin() + i);
-                continue;
-            }
-
-            particle_instances[i].accel.x = 0;
-            particle_instances[i].accel.y = 0;
-
-            // quad_tree.Insert(particle_point);
-
-        }
+        // newest finished step, the simulation keeps stepping meanwhile
+        const Snapshot& snapshot = sim_thread.Acquire();
 
-        // Calculate particle accelerations in parallel
-        int numThreads = std::thread::hardware_concurrency(); // Get the number of available CPU cores
-        std::vector<std::thread> threads;
-        int particlesPerThread = particle_instances.size() / numThreads;
-        int start = 0;
-        int end = 0;
-
-        // Create and start threads
-        for (int i = 0; i < numThreads; i++) {
-            start = i * particlesPerThread;
-            end = (i == numThreads - 1) ? particle_instances.size() : (i + 1) * particlesPerThread;
-            threads.emplace_back(mt_CalcParticleAccels, std::ref(particle_instances), dt, start, end);
-        }
-
-        // Wait for threads to finish
-        for (std::thread& t : threads) {
-            t.join();
-        }
-
-        // After all accelerations are calculated, update particles in parallel
-        std::vector<std::thread> updateThreads;
-
-        // Create and start threads for updating particles
-        for (int i = 0; i < numThreads; i++) {
-            start = i * particlesPerThread;
-            end = (i == numThreads - 1) ? particle_instances.size() : (i + 1) * particlesPerThread;
-            updateThreads.emplace_back(mt_UpdateParticles, std::ref(particle_instances), dt, start, end);
-        }
-
-        // Wait for update threads to finish
-        for (std::thread& t : updateThreads) {
-            t.join();
-        }
+        // the tree is only worth building while circles are drawn (for culling) or it's shown
+        sim_thread.SetPublishTree(!renderer.IsDensityActive() || draw_tree);
 
         // ** Input Handling ** //
 
@@ -183,22 +343,118 @@ int main() {
         // std::cout << "mouse_pos: " << mouse_pos.x << ", " << mouse_pos.y << std::endl;
         // std::cout << "adj pos: " << adj_mouse_pos.x << ", " << adj_mouse_pos.y << std::endl;
 
+        // commands read the simulation's own state when they run, so they
+        // don't depend on how old the snapshot is
+        float spawn_x = adj_mouse_pos.x;
+        float spawn_y = adj_mouse_pos.y;
         if (raylib::Mouse::IsButtonDown(MOUSE_LEFT_BUTTON)) {
-            Particle particle(adj_mouse_pos);
-            particle_instances.push_back(particle);
-
+            sim_thread.Post([=](Simulation& sim) {
+                sim.GetParticles().Add(spawn_x, spawn_y);
+            });
         }
         if (raylib::Mouse::IsButtonDown(MOUSE_RIGHT_BUTTON)) {
             // hehe
-            Particle particle(adj_mouse_pos);
-            particle.mass = -particle.mass;
-            particle_instances.push_back(particle);
+            sim_thread.Post([=](Simulation& sim) {
+                sim.GetParticles().Add(spawn_x, spawn_y, 0.0f, 0.0f, -1000.0f);
+            });
         }
         if (IsKeyPressed(KEY_C)) {
-            particle_instances.clear();
+            sim_thread.Post([](Simulation& sim) {
+                sim.Clear();
+            });
             std::cout << "Screen cleared" << std::endl;
         }
 
+        // cycle exact -> Barnes-Hut -> FMM -> PM to compare them
+        if (IsKeyPressed(KEY_B)) {
+            sim_thread.Post([](Simulation& sim) {
+                sim.SetSolver(static_cast<ForceSolver>((static_cast<int>(sim.GetSolver()) + 1) % 4));
+            });
+        }
+        // paced (one step per frame) or as fast as the simulation goes
+        if (IsKeyPressed(KEY_F)) {
+            sim_thread.SetPaced(!sim_thread.IsPaced());
+        }
+        // instanced rendering and the DrawCircleLines fallback
+        if (IsKeyPressed(KEY_R)) {
+            renderer.SetInstanced(!renderer.IsInstanced());
+        }
+        // quad tree overlay
+        if (IsKeyPressed(KEY_Q)) {
+            draw_tree = !draw_tree;
+        }
+        // density splat when zoomed out on and off
+        if (IsKeyPressed(KEY_L)) {
+            renderer.SetDensityLod(!renderer.IsDensityLod());
+        }
+        // periodic box on and off
+        if (IsKeyPressed(KEY_W)) {
+            sim_thread.Post([](Simulation& sim) {
+                sim.SetPeriodic(!sim.IsPeriodic());
+            });
+        }
+        if (IsKeyPressed(KEY_D)) {
+            sim_thread.Post([](Simulation& sim) {
+                sim.GetDirectSum().SetDeterministic(!sim.GetDirectSum().IsDeterministic());
+            });
+        }
+        if (IsKeyPressed(KEY_V)) {
+            sim_thread.Post([=](Simulation& sim) {
+                DirectSum& direct_sum = sim.GetDirectSum();
+                direct_sum.SetSimdLevel((direct_sum.GetSimdLevel() == SimdLevel::Scalar) ? simd_level : SimdLevel::Scalar);
+            });
+        }
+        if (IsKeyPressed(KEY_P)) {
+            sim_thread.Post([](Simulation& sim) {
+                sim.GetDirectSum().SetBalanced(!sim.GetDirectSum().IsBalanced());
+            });
+        }
+        // cycle euler -> leapfrog -> verlet
+        if (IsKeyPressed(KEY_I)) {
+            sim_thread.Post([](Simulation& sim) {
+                sim.SetIntegrator(static_cast<Integrator>((static_cast<int>(sim.GetIntegrator()) + 1) % 3));
+            });
+        }
+        // block timesteps on and off
+        if (IsKeyPressed(KEY_T)) {
+            int block_levels = (options.block_levels > 0) ? options.block_levels : 4;
+            sim_thread.Post([=](Simulation& sim) {
+                sim.SetBlockLevels((sim.GetBlockLevels() == 0) ? block_levels : 0);
+            });
+        }
+        // [ and ] trade accuracy for speed: theta for Barnes-Hut, the expansion order
+        // for FMM, the grid size for PM
+        if (IsKeyPressed(KEY_LEFT_BRACKET)) {
+            sim_thread.Post([](Simulation& sim) {
+                FastMultipole& fast_multipole = sim.GetFastMultipole();
+                ParticleMesh& particle_mesh = sim.GetParticleMesh();
+                if (sim.GetSolver() == ForceSolver::FastMultipole) {
+                    fast_multipole.SetOrder(fast_multipole.GetOrder() + 1);
+                }
+                else if (sim.GetSolver() == ForceSolver::ParticleMesh) {
+                    particle_mesh.SetGridSize(std::min(4096, particle_mesh.GetGridSize() * 2));
+                }
+                else {
+                    sim.SetTheta(std::max(0.0, sim.GetTheta() - 0.1));
+                }
+            });
+        }
+        if (IsKeyPressed(KEY_RIGHT_BRACKET)) {
+            sim_thread.Post([](Simulation& sim) {
+                FastMultipole& fast_multipole = sim.GetFastMultipole();
+                ParticleMesh& particle_mesh = sim.GetParticleMesh();
+                if (sim.GetSolver() == ForceSolver::FastMultipole) {
+                    fast_multipole.SetOrder(fast_multipole.GetOrder() - 1);
+                }
+                else if (sim.GetSolver() == ForceSolver::ParticleMesh) {
+                    particle_mesh.SetGridSize(std::max(16, particle_mesh.GetGridSize() / 2));
+                }
+                else {
+                    sim.SetTheta(sim.GetTheta() + 0.1);
+                }
+            });
+        }
+
         // middle mouse button panning
         if (raylib::Mouse::IsButtonDown(MOUSE_MIDDLE_BUTTON)) {
             if (!isMiddleMouseButtonDown) {
@@ -233,32 +489,76 @@ int main() {
             cam.BeginMode(); // start drawing to camera
 
             // Draw all particle instances
-            for(const Particle& particle : particle_instances) {
-                particle.Draw();
-            }
+            renderer.Draw(snapshot.particles, cam, snapshot.has_tree ? &snapshot.tree : nullptr);
 
-            // Draw the quadtree 
-            // quad_tree.Draw(cam);
+            // Draw the visible part of the quadtree
+            if (draw_tree && snapshot.has_tree) {
+                snapshot.tree.Draw(cam, CameraBounds(cam));
+            }
 
             // save frames
-            std::string filename = std::format("frames/frame_{:04d}.png", frame_count);
-            raylib::TakeScreenshot(filename.c_str());
+            capture.Capture();
 
             cam.EndMode(); // stop drawing to camera
 
             // Draw FPS
-            std::string fps_text = "FPS: " + std::to_string(window.GetFPS());
+            std::string fps_text = std::format("FPS: {}, step {:.1f} ms{}", 
+                window.GetFPS(), snapshot.stats.step_ms, sim_thread.IsPaced() ? "" : " (unpaced)");
             text_colour.DrawText(font, fps_text.c_str(), {10, 10}, 20, 0);
             // std::cout << fps_text << std::endl;
 
             // Draw number of particles
-            std::string num_particles_text = "Particles: " + std::to_string(particle_instances.size());
+            std::string num_particles_text = "Particles: " + std::to_string(snapshot.particles.Size()) + 
+                (renderer.IsDensityActive() ? " (density)" : 
+                    std::format(" ({}, {} drawn)", renderer.IsInstanced() ? "instanced" : "lines", renderer.GetDrawnCount()));
             text_colour.DrawText(font, num_particles_text.c_str(), {10, 30}, 20, 0);
 
             // Draw simulation speed
             std::string zoom_text = "Zoom: " + std::format("{:.2f}", cam.zoom);
             text_colour.DrawText(font, zoom_text.c_str(), {10, 50}, 20, 0);
 
+            // Draw force solver
+            std::string solver_text;
+            if (snapshot.solver == ForceSolver::Exact) {
+                solver_text = std::format("Solver: exact{}{}", 
+                    (snapshot.simd_level != SimdLevel::Scalar) ? std::format(" ({})", SimdLevelName(snapshot.simd_level)) : "", 
+                    (snapshot.deterministic && snapshot.simd_level == SimdLevel::Scalar) ? " (deterministic)" : "");
+            }
+            else if (snapshot.solver == ForceSolver::BarnesHut) {
+                solver_text = std::format("Solver: Barnes-Hut (theta {:.1f}, {} changed leaf{})", 
+                    snapshot.theta, snapshot.stats.tree_moved, snapshot.stats.tree_rebuilt ? ", rebuilt" : "");
+            }
+            else if (snapshot.solver == ForceSolver::FastMultipole) {
+                solver_text = std::format("Solver: FMM (order {}, depth {})", snapshot.fmm_order, snapshot.fmm_depth);
+            }
+            else {
+                solver_text = std::format("Solver: PM ({}^2 grid)", snapshot.grid_size);
+            }
+            if (snapshot.periodic) {
+                solver_text += ", periodic";
+            }
+            if (snapshot.block_levels > 0) {
+                solver_text += std::format(", block leapfrog (dt {:.4f} / 2^{}, {:.2f} evals per particle)", 
+                    snapshot.dt, snapshot.block_levels, 
+                    static_cast<double>(snapshot.stats.force_evals) / std::max<std::size_t>(1, snapshot.stats.num_particles));
+            }
+            else {
+                solver_text += std::format(", {} (dt {:.4f})", IntegratorName(snapshot.integrator), snapshot.dt);
+            }
+            text_colour.DrawText(font, solver_text.c_str(), {10, 70}, 20, 0);
+
+            // Draw per-thread load balance of the exact solver
+            if (snapshot.solver == ForceSolver::Exact) {
+                const std::vector<double>& thread_times = snapshot.thread_times;
+                double slowest = thread_times.empty() ? 0.0 : *std::max_element(thread_times.begin(), thread_times.end());
+                std::string balance_text = std::format("Threads: {} {}, imbalance {:.2f} (slowest {:.1f} ms)", 
+                    thread_times.size(), 
+                    snapshot.balanced ? "triangular" : "equal", 
+                    snapshot.imbalance, 
+                    slowest);
+                text_colour.DrawText(font, balance_text.c_str(), {10, 90}, 20, 0);
+            }
+
             // Draw keymap legend
             text_colour.DrawText(font, "hi", {10, static_cast<float>(screen_h - 20)}, 20, 0);
         }
@@ -271,27 +571,30 @@ int main() {
         }
     }
 
-    // stitch frames into video
-    std::string input_pattern = "frames/frame_%04d.png";
-    std::string output = "output.mp4";
-
-    std::string ffmpeg_cmd = std::format(
-        "ffmpeg -y -framerate {} -i {} -c:v libx264 -r {} -pix_fmt yuv420p {}",
-        target_fps, input_pattern, target_fps, output);
+    sim_thread.Stop();
 
-    int result = std::system(ffmpeg_cmd.c_str());
-
-        if (result == 0) {
+    // wait for the encoder to drain the queued frames
+    if (capture.Finish()) {
         std::cout << "Video rendered successfully." << std::endl;
     } else {
         std::cerr << "Video failed to render." << std::endl;
         return 1;
     }
-    
-    // frames cleanup
-    for (const auto& entry : std::filesystem::directory_iterator("frames")) {
-        std::filesystem::remove(entry.path());
-    }
 
     return 0;
+}
+
+int main(int argc, char** argv) {
+
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return 1;
+    }
+
+    if (options.headless) {
+        return RunHeadless(options);
+    }
+
+    return RunInteractive(options);
 }
\ No newline at end of file
@@ -0,0 +1,359 @@
+#include "particle_mesh.hpp"
+#include "gravity.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+// in place iterative radix-2 FFT of n = 2^k values,
+// inverse without the 1/n normalization
+static void FFT(std::complex<double>* data, int n, bool inverse) {
+
+    // bit reversal permutation
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[i], data[j]);
+        }
+    }
+
+    for (int length = 2; length <= n; length <<= 1) {
+        double angle = 2 * M_PI / length * (inverse ? 1 : -1);
+        std::complex<double> step(std::cos(angle), std::sin(angle));
+        for (int start = 0; start < n; start += length) {
+            std::complex<double> twiddle(1.0, 0.0);
+            for (int k = 0; k < length / 2; k++) {
+                std::complex<double> even = data[start + k];
+                std::complex<double> odd = data[start + k + length / 2] * twiddle;
+                data[start + k] = even + odd;
+                data[start + k + length / 2] = even - odd;
+                twiddle *= step;
+            }
+        }
+    }
+}
+
+// 2D FFT of a row-major size x size grid: rows, then columns through a per-thread copy
+static void FFT2D(std::vector<std::complex<double>>& grid, int size, bool inverse, ThreadPool& pool) {
+
+    pool.ParallelFor(0, size, [&](int start, int end) {
+        for (int row = start; row < end; row++) {
+            FFT(&grid[row * size], size, inverse);
+        }
+    });
+
+    pool.ParallelFor(0, size, [&](int start, int end) {
+        std::vector<std::complex<double>> column(size);
+        for (int col = start; col < end; col++) {
+            for (int row = 0; row < size; row++) {
+                column[row] = grid[row * size + col];
+            }
+            FFT(column.data(), size, inverse);
+            for (int row = 0; row < size; row++) {
+                grid[row * size + col] = column[row];
+            }
+        }
+    });
+}
+
+ParticleMesh::ParticleMesh(int grid_size) :
+    periodic(false),
+    box(0, 0, 1, 1),
+    simd_level(DetectSimdLevel()),
+    fft_size(0),
+    origin_x(0),
+    origin_y(0),
+    cell_width(1),
+    cutoff_cells(0),
+    root(0, 0, 1, 1),
+    kernel_size(0),
+    kernel_periodic(false),
+    kernel_cutoff(0) {
+    SetGridSize(grid_size);
+}
+
+bool ParticleMesh::IsOutside(const ParticleSystem& particles, int i) const {
+    return !periodic && !root.Contains(Point(particles.x[i], particles.y[i]));
+}
+
+void ParticleMesh::Cloud(const ParticleSystem& particles, int i, int& cell_x, int& cell_y, int& next_x, int& next_y, double& f_x, double& f_y) const {
+
+    int m = grid_size;
+    double u = (particles.x[i] - origin_x) / cell_width;
+    double v = (particles.y[i] - origin_y) / cell_width;
+    if (!periodic) {
+        // Contains() takes the root's far edge and the cell width is only
+        // about root.width / (m - 1) after rounding, so keep the cloud on the grid
+        u = std::clamp(u, 0.0, m - 1.0);
+        v = std::clamp(v, 0.0, m - 1.0);
+    }
+    cell_x = static_cast<int>(std::floor(u));
+    cell_y = static_cast<int>(std::floor(v));
+    if (!periodic) {
+        cell_x = std::min(cell_x, m - 2);
+        cell_y = std::min(cell_y, m - 2);
+    }
+    f_x = u - cell_x;
+    f_y = v - cell_y;
+    next_x = cell_x + 1;
+    next_y = cell_y + 1;
+    if (periodic) {
+        cell_x = ((cell_x % m) + m) % m;
+        cell_y = ((cell_y % m) + m) % m;
+        next_x = (cell_x + 1) % m;
+        next_y = (cell_y + 1) % m;
+    }
+}
+
+void ParticleMesh::BuildKernel(ThreadPool& pool) {
+
+    if (kernel_size == fft_size && kernel_periodic == periodic && kernel_cutoff == cutoff_cells) {
+        return;
+    }
+
+    // acceleration at offset e from a unit mass with unit cell width, -e / |e|^3,
+    // and zero inside the close-approach cutoff like the exact pass.
+    // Offsets wrap at fft_size / 2, which is the nearest image when periodic and
+    // covers every offset of the unpadded grid when isolated
+    kernel_x.assign(fft_size * fft_size, 0.0);
+    kernel_y.assign(fft_size * fft_size, 0.0);
+    for (int j = 0; j < fft_size; j++) {
+        for (int i = 0; i < fft_size; i++) {
+            int e_x = (i < fft_size / 2) ? i : i - fft_size;
+            int e_y = (j < fft_size / 2) ? j : j - fft_size;
+            if (i == fft_size / 2 || j == fft_size / 2) {
+                continue; // the two images at exactly half the box cancel
+            }
+            double distance = std::sqrt(static_cast<double>(e_x * e_x + e_y * e_y));
+            if (distance == 0 || distance < cutoff_cells) {
+                continue;
+            }
+            double factor = -1.0 / (distance * distance * distance);
+            kernel_x[j * fft_size + i] = factor * e_x;
+            kernel_y[j * fft_size + i] = factor * e_y;
+        }
+    }
+
+    FFT2D(kernel_x, fft_size, false, pool);
+    FFT2D(kernel_y, fft_size, false, pool);
+    kernel_size = fft_size;
+    kernel_periodic = periodic;
+    kernel_cutoff = cutoff_cells;
+}
+
+void ParticleMesh::Deposit(const ParticleSystem& particles, ThreadPool& pool) {
+
+    int n = particles.Size();
+    int m = grid_size;
+
+    // largest radius, one partial result per thread
+    int num_threads = pool.GetNumThreads();
+    std::vector<float> partial(num_threads);
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+        float max_radius = 0.0f;
+        for (int i = start; i < end; i++) {
+            max_radius = std::max(max_radius, particles.radius[i]);
+        }
+        partial[thread_id] = max_radius;
+    });
+    float max_radius = *std::max_element(partial.begin(), partial.end());
+
+    if (periodic) {
+        origin_x = box.x;
+        origin_y = box.y;
+        cell_width = static_cast<double>(box.width) / m;
+    }
+    else {
+        // The grid covers the core square, the few particles outside it are
+        // summed directly. The last node stays empty so every cloud has its
+        // right and top neighbours. The cell width is rounded up to a quarter
+        // power of two, so the kernel (which depends on the cutoff in cells)
+        // is only rebuilt when the system grows or shrinks by about a fifth
+        root = CoreSquare(particles, pool);
+        double needed = static_cast<double>(root.width) / (m - 1);
+        cell_width = std::exp2(std::ceil(4 * std::log2(needed)) / 4);
+        origin_x = root.x;
+        origin_y = root.y;
+    }
+    cutoff_cells = 40.0 * max_radius / cell_width;
+
+    // each thread deposits its range into its own grid and lists the particles outside
+    thread_masses.resize(num_threads);
+    thread_outside.resize(num_threads);
+    pool.Run([&](int thread_id, int num_threads) {
+        std::vector<double>& masses = thread_masses[thread_id];
+        masses.assign(m * m, 0.0);
+        thread_outside[thread_id].clear();
+
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+        for (int i = start; i < end; i++) {
+            if (IsOutside(particles, i)) {
+                thread_outside[thread_id].push_back(i);
+                continue;
+            }
+
+            int cell_x, cell_y, next_x, next_y;
+            double f_x, f_y;
+            Cloud(particles, i, cell_x, cell_y, next_x, next_y, f_x, f_y);
+
+            double mass = particles.mass[i];
+            masses[cell_y * m + cell_x] += mass * (1 - f_x) * (1 - f_y);
+            masses[cell_y * m + next_x] += mass * f_x * (1 - f_y);
+            masses[next_y * m + cell_x] += mass * (1 - f_x) * f_y;
+            masses[next_y * m + next_x] += mass * f_x * f_y;
+        }
+    });
+
+    // in index order, with their fields gathered for the row kernel
+    outside.clear();
+    for (const std::vector<int>& indices : thread_outside) {
+        outside.insert(outside.end(), indices.begin(), indices.end());
+    }
+    outside_x.resize(outside.size());
+    outside_y.resize(outside.size());
+    outside_mass.resize(outside.size());
+    outside_radius.resize(outside.size());
+    for (std::size_t k = 0; k < outside.size(); k++) {
+        outside_x[k] = particles.x[outside[k]];
+        outside_y[k] = particles.y[outside[k]];
+        outside_mass[k] = particles.mass[outside[k]];
+        outside_radius[k] = particles.radius[outside[k]];
+    }
+
+    // reduce into the (padded) density grid
+    fft_size = periodic ? m : 2 * m;
+    density.assign(fft_size * fft_size, 0.0);
+    pool.ParallelFor(0, m, [&](int start, int end) {
+        for (int row = start; row < end; row++) {
+            for (int col = 0; col < m; col++) {
+                double sum = 0;
+                for (const std::vector<double>& masses : thread_masses) {
+                    sum += masses[row * m + col];
+                }
+                density[row * fft_size + col] = sum;
+            }
+        }
+    });
+}
+
+void ParticleMesh::Solve(ThreadPool& pool) {
+
+    BuildKernel(pool);
+
+    FFT2D(density, fft_size, false, pool);
+
+    // multiply by the kernel transforms, with the inverse FFT's 1/size^2 and
+    // the cell width folded into one scale
+    double scale = G / (cell_width * cell_width) / (static_cast<double>(fft_size) * fft_size);
+    field_x.resize(fft_size * fft_size);
+    field_y.resize(fft_size * fft_size);
+    pool.ParallelFor(0, fft_size * fft_size, [&](int start, int end) {
+        for (int k = start; k < end; k++) {
+            field_x[k] = density[k] * kernel_x[k] * scale;
+            field_y[k] = density[k] * kernel_y[k] * scale;
+        }
+    });
+
+    FFT2D(field_x, fft_size, true, pool);
+    FFT2D(field_y, fft_size, true, pool);
+}
+
+void ParticleMesh::Interpolate(const ParticleSystem& particles, float* out_x, float* out_y, ThreadPool& pool) {
+
+    pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+        for (int i = start; i < end; i++) {
+            // off the grid, the pull of everyone summed directly
+            if (IsOutside(particles, i)) {
+                float sum_x = 0.0f;
+                float sum_y = 0.0f;
+                SumRowSimd(particles.x.data(), particles.y.data(), particles.mass.data(), particles.radius.data(), 0, particles.Size(), 
+                    particles.x[i], particles.y[i], particles.radius[i], sum_x, sum_y, simd_level);
+                out_x[i] = G * sum_x;
+                out_y[i] = G * sum_y;
+                continue;
+            }
+
+            // same cloud as the deposit, so a particle doesn't push itself
+            int cell_x, cell_y, next_x, next_y;
+            double f_x, f_y;
+            Cloud(particles, i, cell_x, cell_y, next_x, next_y, f_x, f_y);
+
+            auto gather = [&](const std::vector<std::complex<double>>& field) {
+                return (1 - f_x) * (1 - f_y) * field[cell_y * fft_size + cell_x].real() +
+                       f_x * (1 - f_y) * field[cell_y * fft_size + next_x].real() +
+                       (1 - f_x) * f_y * field[next_y * fft_size + cell_x].real() +
+                       f_x * f_y * field[next_y * fft_size + next_x].real();
+            };
+            out_x[i] = gather(field_x);
+            out_y[i] = gather(field_y);
+
+            // plus the pull of the particles off the grid
+            if (!outside.empty()) {
+                float sum_x = 0.0f;
+                float sum_y = 0.0f;
+                SumRowSimd(outside_x.data(), outside_y.data(), outside_mass.data(), outside_radius.data(), 0, outside.size(), 
+                    particles.x[i], particles.y[i], particles.radius[i], sum_x, sum_y, simd_level);
+                out_x[i] += G * sum_x;
+                out_y[i] += G * sum_y;
+            }
+        }
+    });
+}
+
+void ParticleMesh::CalcAccels(ParticleSystem& particles, ThreadPool& pool) {
+
+    if (particles.Size() == 0) {
+        return;
+    }
+
+    Deposit(particles, pool);
+    Solve(pool);
+    Interpolate(particles, particles.ax.data(), particles.ay.data(), pool);
+}
+
+void ParticleMesh::CalcActiveAccels(ParticleSystem& particles, const std::vector<int>& active, ThreadPool& pool) {
+
+    if (particles.Size() == 0) {
+        return;
+    }
+
+    // the mesh costs the same for any number of targets, so interpolate
+    // everyone and keep the accelerations of the active particles
+    accel_x.resize(particles.Size());
+    accel_y.resize(particles.Size());
+
+    Deposit(particles, pool);
+    Solve(pool);
+    Interpolate(particles, accel_x.data(), accel_y.data(), pool);
+
+    for (int i : active) {
+        particles.ax[i] = accel_x[i];
+        particles.ay[i] = accel_y[i];
+    }
+}
+
+void ParticleMesh::SetGridSize(int grid_size) {
+    this->grid_size = 2;
+    while (this->grid_size < grid_size) {
+        this->grid_size *= 2;
+    }
+}
+
+int ParticleMesh::GetGridSize() const {
+    return grid_size;
+}
+
+void ParticleMesh::SetPeriodic(bool periodic, const Quad& box) {
+    this->periodic = periodic;
+    this->box = box;
+}
+
+bool ParticleMesh::IsPeriodic() const {
+    return periodic;
+}
\ No newline at end of file
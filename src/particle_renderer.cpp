@@ -0,0 +1,326 @@
+#include "particle_renderer.hpp"
+#include "particle.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <rlgl.h>
+#include <raymath.h>
+
+// vertex attribute locations, clear of the ones raylib binds (0 - 5) except the position
+static const int corner_location = 0;
+static const int instance_location = 6; // x, y, radius
+static const int colour_location = 7;
+
+static const char* vertex_shader = R"(#version 330
+layout(location = 0) in vec2 vertexPosition; // quad corner, -1 to 1
+layout(location = 6) in vec3 instancePosition; // x, y, radius
+layout(location = 7) in vec4 instanceColour;
+
+uniform mat4 mvp;
+
+out vec2 local;
+out vec4 colour;
+
+void main() {
+    local = vertexPosition;
+    colour = instanceColour;
+    gl_Position = mvp * vec4(instancePosition.xy + vertexPosition * instancePosition.z, 0.0, 1.0);
+}
+)";
+
+// a ring one pixel wide just inside the radius, like DrawCircleLines,
+// anti-aliased over the pixel footprint of the quad
+static const char* fragment_shader = R"(#version 330
+in vec2 local;
+in vec4 colour;
+
+out vec4 finalColor;
+
+void main() {
+    float d = length(local);
+    float pixel = fwidth(d);
+    float alpha = 1.0 - clamp(abs(d - 1.0 + pixel) / pixel, 0.0, 1.0);
+    if (alpha <= 0.0) {
+        discard;
+    }
+    finalColor = vec4(colour.rgb, colour.a * alpha);
+}
+)";
+
+// log(1 + count) / log(1 + max count) to colour: dark violet for sparse
+// cells, the particles' magenta, then white for the densest ones
+static Color ToneMap(std::uint32_t count, float scale) {
+
+    if (count == 0) {
+        return Color{0, 0, 0, 0};
+    }
+
+    float t = std::log1p(static_cast<float>(count)) * scale;
+    if (t < 0.6f) {
+        float s = t / 0.6f;
+        return Color{static_cast<unsigned char>(60 + 195 * s), 0, static_cast<unsigned char>(120 + 135 * s), 255};
+    }
+    float s = std::min(1.0f, (t - 0.6f) / 0.4f);
+    return Color{255, static_cast<unsigned char>(255 * s), 255, 255};
+}
+
+ParticleRenderer::ParticleRenderer(int num_threads) :
+    supported(false),
+    instanced(false),
+    shader{},
+    mvp_loc(-1),
+    vao(0),
+    corner_vbo(0),
+    instance_vbo(0),
+    capacity(0),
+    drawn_count(0),
+    density_lod(true),
+    density_active(false),
+    lod_pixel_size(1.0f),
+    lod_cell_size(2),
+    pool(num_threads),
+    density_texture{} {
+
+    if (rlGetVersion() != RL_OPENGL_33 && rlGetVersion() != RL_OPENGL_43) {
+        return;
+    }
+
+    shader = LoadShaderFromMemory(vertex_shader, fragment_shader);
+    if (shader.id == 0 || shader.id == rlGetShaderIdDefault()) {
+        return; // compile errors are logged by raylib
+    }
+    mvp_loc = GetShaderLocation(shader, "mvp");
+
+    vao = rlLoadVertexArray();
+    if (vao == 0) {
+        UnloadShader(shader);
+        return;
+    }
+
+    // two triangles covering the unit quad
+    const float corners[12] = {-1, -1, 1, -1, 1, 1, -1, -1, 1, 1, -1, 1};
+    rlEnableVertexArray(vao);
+    corner_vbo = rlLoadVertexBuffer(corners, sizeof(corners), false);
+    rlSetVertexAttribute(corner_location, 2, RL_FLOAT, false, 0, 0);
+    rlEnableVertexAttribute(corner_location);
+    rlDisableVertexArray();
+
+    supported = true;
+    instanced = true;
+}
+
+ParticleRenderer::~ParticleRenderer() {
+    if (density_texture.id != 0) {
+        UnloadTexture(density_texture);
+    }
+    if (!supported) {
+        return;
+    }
+    rlUnloadVertexBuffer(instance_vbo);
+    rlUnloadVertexBuffer(corner_vbo);
+    rlUnloadVertexArray(vao);
+    UnloadShader(shader);
+}
+
+void ParticleRenderer::DrawInstanced(const ParticleSystem& particles, const std::vector<int>* subset) {
+
+    std::size_t n = subset ? subset->size() : particles.Size();
+    if (n == 0) {
+        return;
+    }
+
+    instances.resize(n);
+    for (std::size_t k = 0; k < n; k++) {
+        std::size_t i = subset ? (*subset)[k] : k;
+        raylib::Color colour = ParticleColour(particles.vx[i], particles.vy[i], particles.mass[i]);
+        instances[k] = {particles.x[i], particles.y[i], particles.radius[i], {colour.r, colour.g, colour.b, colour.a}};
+    }
+
+    rlEnableVertexArray(vao);
+    if (n > capacity) {
+        // reallocate with some headroom and point the instance attributes at the new buffer
+        capacity = std::max(n, 2 * capacity);
+        rlUnloadVertexBuffer(instance_vbo);
+        instance_vbo = rlLoadVertexBuffer(nullptr, static_cast<int>(capacity * sizeof(Instance)), true);
+        rlSetVertexAttribute(instance_location, 3, RL_FLOAT, false, sizeof(Instance), offsetof(Instance, x));
+        rlSetVertexAttribute(colour_location, 4, RL_UNSIGNED_BYTE, true, sizeof(Instance), offsetof(Instance, colour));
+        rlSetVertexAttributeDivisor(instance_location, 1);
+        rlSetVertexAttributeDivisor(colour_location, 1);
+        rlEnableVertexAttribute(instance_location);
+        rlEnableVertexAttribute(colour_location);
+    }
+    rlUpdateVertexBuffer(instance_vbo, instances.data(), static_cast<int>(n * sizeof(Instance)), 0);
+
+    // whatever raylib has batched so far goes first, then the camera
+    // transform of the current mode is handed to the shader
+    rlDrawRenderBatchActive();
+    rlEnableShader(shader.id);
+    rlSetUniformMatrix(mvp_loc, MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection()));
+    rlDrawVertexArrayInstanced(0, 6, static_cast<int>(n));
+    rlDisableShader();
+    rlDisableVertexArray();
+}
+
+float ParticleRenderer::MaxPixelSize(const ParticleSystem& particles, float zoom) {
+
+    int n = particles.Size();
+    std::vector<float> partial(pool.GetNumThreads(), 0.0f);
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+        float max_radius = 0.0f;
+        for (int i = start; i < end; i++) {
+            max_radius = std::max(max_radius, particles.radius[i]);
+        }
+        partial[thread_id] = max_radius;
+    });
+
+    return 2 * zoom * *std::max_element(partial.begin(), partial.end());
+}
+
+void ParticleRenderer::DrawDensity(const ParticleSystem& particles, const Camera2D& cam) {
+
+    int cell = lod_cell_size;
+    int width = (GetScreenWidth() + cell - 1) / cell;
+    int height = (GetScreenHeight() + cell - 1) / cell;
+    std::size_t num_cells = static_cast<std::size_t>(width) * height;
+    int n = particles.Size();
+
+    // every thread bins its range into its own grid, screen = (world - target) * zoom + offset
+    thread_counts.resize(pool.GetNumThreads());
+    pool.Run([&](int thread_id, int num_threads) {
+        std::vector<std::uint32_t>& grid = thread_counts[thread_id];
+        grid.assign(num_cells, 0);
+
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+        float scale = cam.zoom / cell;
+        float shift_x = cam.offset.x / cell - cam.target.x * scale;
+        float shift_y = cam.offset.y / cell - cam.target.y * scale;
+        for (int i = start; i < end; i++) {
+            float u = particles.x[i] * scale + shift_x;
+            float v = particles.y[i] * scale + shift_y;
+            if (u >= 0 && v >= 0 && u < width && v < height) {
+                grid[static_cast<int>(v) * width + static_cast<int>(u)]++;
+            }
+        }
+    });
+
+    // sum the grids row by row, keeping the largest count
+    counts.resize(num_cells);
+    std::vector<std::uint32_t> max_counts(pool.GetNumThreads(), 0);
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = height * thread_id / num_threads;
+        int end = height * (thread_id + 1) / num_threads;
+        std::uint32_t max_count = 0;
+        for (std::size_t k = static_cast<std::size_t>(start) * width; k < static_cast<std::size_t>(end) * width; k++) {
+            std::uint32_t sum = 0;
+            for (const std::vector<std::uint32_t>& grid : thread_counts) {
+                sum += grid[k];
+            }
+            counts[k] = sum;
+            max_count = std::max(max_count, sum);
+        }
+        max_counts[thread_id] = max_count;
+    });
+
+    float scale = 1.0f / std::log1p(static_cast<float>(std::max(1u, *std::max_element(max_counts.begin(), max_counts.end()))));
+    pixels.resize(num_cells);
+    pool.ParallelFor(0, num_cells, [&](int start, int end) {
+        for (int k = start; k < end; k++) {
+            pixels[k] = ToneMap(counts[k], scale);
+        }
+    });
+
+    // the texture follows the window size
+    if (density_texture.id == 0 || density_texture.width != width || density_texture.height != height) {
+        if (density_texture.id != 0) {
+            UnloadTexture(density_texture);
+        }
+        Image image = GenImageColor(width, height, BLANK);
+        density_texture = LoadTextureFromImage(image);
+        UnloadImage(image);
+    }
+    UpdateTexture(density_texture, pixels.data());
+
+    // drawn in world space over the view, since we're inside the camera mode
+    Vector2 top_left = GetScreenToWorld2D(Vector2{0, 0}, cam);
+    Rectangle source = {0, 0, static_cast<float>(width), static_cast<float>(height)};
+    Rectangle dest = {top_left.x, top_left.y, width * cell / cam.zoom, height * cell / cam.zoom};
+    DrawTexturePro(density_texture, source, dest, Vector2{0, 0}, 0.0f, WHITE);
+}
+
+void ParticleRenderer::Draw(const ParticleSystem& particles, const Camera2D& cam, const QuadTree* tree) {
+
+    drawn_count = 0;
+    density_active = density_lod && particles.Size() > 0 && MaxPixelSize(particles, cam.zoom) < lod_pixel_size;
+    if (density_active) {
+        DrawDensity(particles, cam);
+        return;
+    }
+
+    // the view grows by the largest radius so circles poking in from outside still show
+    const std::vector<int>* subset = nullptr;
+    if (tree) {
+        Quad view = CameraBounds(cam);
+        float margin = tree->GetMaxSize();
+        visible.clear();
+        tree->Query(Quad(view.x - margin, view.y - margin, view.width + 2 * margin, view.height + 2 * margin), visible);
+        subset = &visible;
+    }
+    drawn_count = subset ? subset->size() : particles.Size();
+
+    if (instanced) {
+        DrawInstanced(particles, subset);
+        return;
+    }
+
+    for (std::size_t k = 0; k < drawn_count; k++) {
+        Particle(particles, subset ? (*subset)[k] : k).Draw();
+    }
+}
+
+bool ParticleRenderer::IsSupported() const {
+    return supported;
+}
+
+void ParticleRenderer::SetInstanced(bool instanced) {
+    this->instanced = instanced && supported;
+}
+
+bool ParticleRenderer::IsInstanced() const {
+    return instanced;
+}
+
+void ParticleRenderer::SetDensityLod(bool density_lod) {
+    this->density_lod = density_lod;
+}
+
+bool ParticleRenderer::IsDensityLod() const {
+    return density_lod;
+}
+
+bool ParticleRenderer::IsDensityActive() const {
+    return density_active;
+}
+
+std::size_t ParticleRenderer::GetDrawnCount() const {
+    return drawn_count;
+}
+
+void ParticleRenderer::SetLodPixelSize(float lod_pixel_size) {
+    this->lod_pixel_size = lod_pixel_size;
+}
+
+float ParticleRenderer::GetLodPixelSize() const {
+    return lod_pixel_size;
+}
+
+void ParticleRenderer::SetLodCellSize(int lod_cell_size) {
+    this->lod_cell_size = std::max(1, lod_cell_size);
+}
+
+int ParticleRenderer::GetLodCellSize() const {
+    return lod_cell_size;
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include "particle_system.hpp"
+
+void ParticleSystem::Add(float pos_x, float pos_y, float vel_x, float vel_y, float mass, float radius) {
+    x.push_back(pos_x);
+    y.push_back(pos_y);
+    vx.push_back(vel_x);
+    vy.push_back(vel_y);
+    ax.push_back(0.0f);
+    ay.push_back(0.0f);
+    this->mass.push_back(mass);
+    this->radius.push_back(radius);
+    level.push_back(0);
+    id.push_back(next_id++);
+}
+
+void ParticleSystem::Clear() {
+    x.clear();
+    y.clear();
+    vx.clear();
+    vy.clear();
+    ax.clear();
+    ay.clear();
+    mass.clear();
+    radius.clear();
+    level.clear();
+    id.clear();
+}
+
+void ParticleSystem::Reserve(std::size_t n) {
+    x.reserve(n);
+    y.reserve(n);
+    vx.reserve(n);
+    vy.reserve(n);
+    ax.reserve(n);
+    ay.reserve(n);
+    mass.reserve(n);
+    radius.reserve(n);
+    level.reserve(n);
+    id.reserve(n);
+}
+
+void ParticleSystem::Resize(std::size_t n) {
+    x.resize(n);
+    y.resize(n);
+    vx.resize(n);
+    vy.resize(n);
+    ax.resize(n);
+    ay.resize(n);
+    mass.resize(n);
+    radius.resize(n);
+    level.resize(n);
+    id.resize(n);
+}
+
+void ParticleSystem::Gather(const ParticleSystem& source, const int* order, std::size_t start, std::size_t end) {
+    for (std::size_t k = start; k < end; k++) {
+        int i = order[k];
+        x[k] = source.x[i];
+        y[k] = source.y[i];
+        vx[k] = source.vx[i];
+        vy[k] = source.vy[i];
+        ax[k] = source.ax[i];
+        ay[k] = source.ay[i];
+        mass[k] = source.mass[i];
+        radius[k] = source.radius[i];
+        level[k] = source.level[i];
+        id[k] = source.id[i];
+    }
+}
+
+void ParticleSystem::ResetAccels(std::size_t start, std::size_t end) {
+    for (std::size_t i = start; i < end; i++) {
+        ax[i] = 0.0f;
+        ay[i] = 0.0f;
+    }
+}
+
+void ParticleSystem::Kick(double dt, std::size_t start, std::size_t end) {
+    for (std::size_t i = start; i < end; i++) {
+        vx[i] += ax[i] * dt;
+        vy[i] += ay[i] * dt;
+    }
+}
+
+void ParticleSystem::Drift(double dt, std::size_t start, std::size_t end) {
+    for (std::size_t i = start; i < end; i++) {
+        x[i] += vx[i] * dt;
+        y[i] += vy[i] * dt;
+    }
+}
+
+std::size_t ParticleSystem::Size() const {
+    return x.size();
+}
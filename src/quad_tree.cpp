@@ -1,82 +1,938 @@
 #include "quad_tree.hpp"
+#include "gravity.hpp"
 
-QuadTree::QuadTree(const Quad &boundary, int capacity) :
-    boundary(boundary), 
-    capacity(capacity),
-    points(),
-    divided(false),
-    is_master(true) {}
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+Quad CameraBounds(const Camera2D& cam) {
+
+    Vector2 top_left = GetScreenToWorld2D(Vector2{0, 0}, cam);
+    return Quad(top_left.x, top_left.y, GetScreenWidth() / cam.zoom, GetScreenHeight() / cam.zoom);
+}
+
+// lowest and highest x and y over [start, end)
+static void Extent(const ParticleSystem& particles, int start, int end, float out[4]) {
+    float min_x = 1e30f, min_y = 1e30f, max_x = -1e30f, max_y = -1e30f;
+    for (int i = start; i < end; i++) {
+        min_x = std::min(min_x, particles.x[i]);
+        min_y = std::min(min_y, particles.y[i]);
+        max_x = std::max(max_x, particles.x[i]);
+        max_y = std::max(max_y, particles.y[i]);
+    }
+    out[0] = min_x; out[1] = min_y; out[2] = max_x; out[3] = max_y;
+}
+
+static Quad SquareOver(const float extent[4]) {
+    if (extent[0] > extent[2]) {
+        return Quad(0, 0, 1, 1); // no particles
+    }
+    float width = std::max(std::max(extent[2] - extent[0], extent[3] - extent[1]), 1.0f) * 1.0001f;
+    return Quad(extent[0], extent[1], width, width);
+}
+
+Quad BoundingSquare(const ParticleSystem& particles) {
+    float extent[4];
+    Extent(particles, 0, particles.Size(), extent);
+    return SquareOver(extent);
+}
 
-QuadTree::QuadTree(const Quad &boundary, int capacity, bool is_master) :
-    boundary(boundary), 
+Quad BoundingSquare(const ParticleSystem& particles, ThreadPool& pool) {
+
+    int n = particles.Size();
+    std::vector<float> partial(4 * pool.GetNumThreads());
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+        Extent(particles, start, end, &partial[4 * thread_id]);
+    });
+
+    float extent[4] = {1e30f, 1e30f, -1e30f, -1e30f};
+    for (std::size_t t = 0; t < partial.size(); t += 4) {
+        extent[0] = std::min(extent[0], partial[t]);
+        extent[1] = std::min(extent[1], partial[t + 1]);
+        extent[2] = std::max(extent[2], partial[t + 2]);
+        extent[3] = std::max(extent[3], partial[t + 3]);
+    }
+    return SquareOver(extent);
+}
+
+// lowest and highest x and y over the particles of [start, end) inside box, returns how many aren't
+static int ExtentInside(const ParticleSystem& particles, const Quad& box, int start, int end, float out[4]) {
+    float min_x = 1e30f, min_y = 1e30f, max_x = -1e30f, max_y = -1e30f;
+    int num_outside = 0;
+    for (int i = start; i < end; i++) {
+        if (!box.Contains(Point(particles.x[i], particles.y[i]))) {
+            num_outside++;
+            continue;
+        }
+        min_x = std::min(min_x, particles.x[i]);
+        min_y = std::min(min_y, particles.y[i]);
+        max_x = std::max(max_x, particles.x[i]);
+        max_y = std::max(max_y, particles.y[i]);
+    }
+    out[0] = min_x; out[1] = min_y; out[2] = max_x; out[3] = max_y;
+    return num_outside;
+}
+
+Quad BoundingSquare(const ParticleSystem& particles, const Quad& box, int& num_outside, ThreadPool& pool) {
+
+    int n = particles.Size();
+    std::vector<float> partial(4 * pool.GetNumThreads());
+    std::vector<int> partial_outside(pool.GetNumThreads());
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+        partial_outside[thread_id] = ExtentInside(particles, box, start, end, &partial[4 * thread_id]);
+    });
+
+    float extent[4] = {1e30f, 1e30f, -1e30f, -1e30f};
+    for (std::size_t t = 0; t < partial.size(); t += 4) {
+        extent[0] = std::min(extent[0], partial[t]);
+        extent[1] = std::min(extent[1], partial[t + 1]);
+        extent[2] = std::max(extent[2], partial[t + 2]);
+        extent[3] = std::max(extent[3], partial[t + 3]);
+    }
+    num_outside = 0;
+    for (int outside : partial_outside) {
+        num_outside += outside;
+    }
+    return SquareOver(extent);
+}
+
+Quad CoreSquare(const ParticleSystem& particles, ThreadPool& pool, int max_outside) {
+
+    Quad bounds = BoundingSquare(particles, pool);
+    int n = particles.Size();
+    if (n == 0) {
+        return bounds;
+    }
+
+    // 1st and 99th percentiles of x and y from an evenly strided sample,
+    // twice that box around its center takes in the edge of the distribution
+    int samples = std::min(n, 4096);
+    std::vector<float> sample_x(samples);
+    std::vector<float> sample_y(samples);
+    for (int s = 0; s < samples; s++) {
+        int i = static_cast<int>(static_cast<long long>(n) * s / samples);
+        sample_x[s] = particles.x[i];
+        sample_y[s] = particles.y[i];
+    }
+    int low = samples / 100;
+    int high = samples - 1 - low;
+    std::nth_element(sample_x.begin(), sample_x.begin() + low, sample_x.end());
+    float low_x = sample_x[low];
+    std::nth_element(sample_x.begin() + low, sample_x.begin() + high, sample_x.end());
+    float high_x = sample_x[high];
+    std::nth_element(sample_y.begin(), sample_y.begin() + low, sample_y.end());
+    float low_y = sample_y[low];
+    std::nth_element(sample_y.begin() + low, sample_y.begin() + high, sample_y.end());
+    float high_y = sample_y[high];
+
+    float width = std::max(std::max(high_x - low_x, high_y - low_y), 0.5f);
+    Quad box(0.5f * (low_x + high_x) - width, 0.5f * (low_y + high_y) - width, 2 * width, 2 * width);
+
+    // too many out there is a halo, not a few ejected particles, and
+    // outliers that don't even double the root aren't worth summing directly
+    int num_outside;
+    Quad core = BoundingSquare(particles, box, num_outside, pool);
+    if (num_outside == 0 || num_outside > max_outside || bounds.width <= 2 * core.width) {
+        return bounds;
+    }
+    return core;
+}
+
+QuadTree::QuadTree(int capacity, int max_depth) :
     capacity(capacity),
-    points(),
-    divided(false),
-    is_master(is_master) {}
+    max_depth(std::clamp(max_depth, 0, 30)),
+    boundary(0, 0, 0, 0),
+    cell_scale_x(0),
+    cell_scale_y(0),
+    particles(nullptr),
+    num_particles(0),
+    key_levels(0),
+    moved_count(0),
+    rebuilt(false) {}
+
+void QuadTree::Build(const Quad& boundary, const ParticleSystem& particles) {
+
+    this->boundary = boundary;
+    cell_scale_x = (1 << max_depth) / static_cast<double>(boundary.width);
+    cell_scale_y = (1 << max_depth) / static_cast<double>(boundary.height);
+    this->particles = &particles;
+    num_particles = particles.Size();
+    key_levels = 0;
+    nodes.clear();
+    order.clear();
+    outside.clear();
+    free_blocks.clear();
+    moved_count = 0;
+    rebuilt = true;
+
+    // particles outside the boundary are left out
+    int n = particles.Size();
+    for (int i = 0; i < n; i++) {
+        if (boundary.Contains(Point(particles.x[i], particles.y[i]))) {
+            order.push_back(i);
+        }
+        else {
+            outside.push_back(i);
+        }
+    }
+    scratch.resize(order.size());
+
+    nodes.push_back(Node{boundary, -1, 0, static_cast<int>(order.size()), 0, 0, 0, 0, 0});
+    Subdivide(nodes, 0, 0);
+}
+
+// 0b abcd -> 0b 0a0b0c0d
+static std::uint64_t SpreadBits(std::uint32_t bits) {
+
+    std::uint64_t x = bits;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
+    x = (x | (x << 2)) & 0x3333333333333333ull;
+    x = (x | (x << 1)) & 0x5555555555555555ull;
+    return x;
+}
+
+// clamped to 0 first, so the truncation floors
+std::uint32_t QuadTree::CellX(float x) const {
+    return static_cast<std::uint32_t>(std::clamp((x - boundary.x) * cell_scale_x, 0.0, (1 << max_depth) - 1.0));
+}
+
+std::uint32_t QuadTree::CellY(float y) const {
+    return static_cast<std::uint32_t>(std::clamp((y - boundary.y) * cell_scale_y, 0.0, (1 << max_depth) - 1.0));
+}
+
+std::uint64_t QuadTree::MortonKey(float x, float y) const {
+    return (SpreadBits(CellY(y)) << 1) | SpreadBits(CellX(x));
+}
 
-void QuadTree::Subdivide() {
-    
-    divided = true;
+int QuadTree::Quadrant(int j, int level) const {
+    int shift = max_depth - 1 - level;
+    return ((CellY(particles->y[j]) >> shift) & 1) * 2 + ((CellX(particles->x[j]) >> shift) & 1);
+}
 
-    int x = boundary.x;
-    int y = boundary.y;
-    int w = boundary.width;
-    int h = boundary.height;
+void QuadTree::RadixSort(ThreadPool& pool) {
 
-    Quad ne_boundary = Quad(x + w/2, y, w/2, h/2);
-    ne = std::make_unique<QuadTree>(ne_boundary, capacity, false);
+    // 8 bit digits, only as many passes as the keys have bits
+    const int radix = 256;
+    int n = keys.size();
+    int bits = 2 * key_levels;
+    key_scratch.resize(n);
+    scratch.resize(n);
+    thread_counts.resize(pool.GetNumThreads() * radix);
+    int swaps = 0;
 
-    Quad nw_boundary = Quad(x, y, w/2, h/2);
-    nw = std::make_unique<QuadTree>(nw_boundary, capacity, false);
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+        std::uint64_t* src_keys = keys.data();
+        std::uint64_t* dst_keys = key_scratch.data();
+        int* src = order.data();
+        int* dst = scratch.data();
 
-    Quad se_boundary = Quad(x + w/2, y + h/2, w/2, h/2);
-    se = std::make_unique<QuadTree>(se_boundary, capacity, false);
+        for (int shift = 0; shift < bits; shift += 8) {
+            int* counts = &thread_counts[thread_id * radix];
+            std::fill(counts, counts + radix, 0);
+            for (int k = start; k < end; k++) {
+                counts[(src_keys[k] >> shift) & (radix - 1)]++;
+            }
+            pool.Sync();
 
-    Quad sw_boundary = Quad(x, y + h/2, w/2, h/2);
-    sw = std::make_unique<QuadTree>(sw_boundary, capacity, false);
+            // this thread's slice of every digit comes after the lower digits
+            // and the earlier threads' slices of the same digit, so the sort is stable
+            int offsets[radix];
+            int total = 0;
+            bool skip = false;
+            for (int digit = 0; digit < radix; digit++) {
+                int digit_count = 0;
+                for (int t = 0; t < num_threads; t++) {
+                    if (t == thread_id) {
+                        offsets[digit] = total;
+                    }
+                    digit_count += thread_counts[t * radix + digit];
+                    total += thread_counts[t * radix + digit];
+                }
+                // every key has the same digit, nothing would move
+                skip = skip || digit_count == n;
+            }
+
+            if (!skip) {
+                for (int k = start; k < end; k++) {
+                    int o = offsets[(src_keys[k] >> shift) & (radix - 1)]++;
+                    dst_keys[o] = src_keys[k];
+                    dst[o] = src[k];
+                }
+                std::swap(src_keys, dst_keys);
+                std::swap(src, dst);
+                if (thread_id == 0) {
+                    swaps++;
+                }
+            }
+            pool.Sync();
+        }
+    });
+
+    // odd number of passes, the sorted keys ended up in the scratch buffers
+    if (swaps % 2 == 1) {
+        std::swap(keys, key_scratch);
+        std::swap(order, scratch);
+    }
 }
 
-bool QuadTree::Insert(const Point &point) {
+void QuadTree::Build(const Quad& boundary, const ParticleSystem& particles, ThreadPool& pool) {
 
-    if (!boundary.Contains(point)) {
-        return false;
+    this->boundary = boundary;
+    cell_scale_x = (1 << max_depth) / static_cast<double>(boundary.width);
+    cell_scale_y = (1 << max_depth) / static_cast<double>(boundary.height);
+    this->particles = &particles;
+    num_particles = particles.Size();
+    key_levels = max_depth;
+    nodes.clear();
+    outside.clear();
+    free_blocks.clear();
+    moved_count = 0;
+    rebuilt = true;
+
+    // count the particles inside per thread, then every thread writes the
+    // keys of its own ones after the earlier threads', keeping index order
+    int n = particles.Size();
+    keys.resize(n);
+    order.resize(n);
+    thread_counts.assign(pool.GetNumThreads() + 1, 0);
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads);
+
+        int inside = 0;
+        for (int i = start; i < end; i++) {
+            inside += boundary.Contains(Point(particles.x[i], particles.y[i]));
+        }
+        thread_counts[thread_id + 1] = inside;
+        pool.Sync();
+
+        int k = 0;
+        for (int t = 1; t <= thread_id; t++) {
+            k += thread_counts[t];
+        }
+        for (int i = start; i < end; i++) {
+            if (boundary.Contains(Point(particles.x[i], particles.y[i]))) {
+                keys[k] = MortonKey(particles.x[i], particles.y[i]);
+                order[k] = i;
+                k++;
+            }
+        }
+    });
+
+    int count = 0;
+    for (int inside : thread_counts) {
+        count += inside;
+    }
+    keys.resize(count);
+    order.resize(count);
+    if (count < n) {
+        for (int i = 0; i < n; i++) {
+            if (!boundary.Contains(Point(particles.x[i], particles.y[i]))) {
+                outside.push_back(i);
+            }
+        }
+    }
+    RadixSort(pool);
+
+    nodes.push_back(Node{boundary, -1, 0, count, 0, 0, 0, 0, 0});
+    if (pool.GetNumThreads() == 1) {
+        Subdivide(nodes, 0, 0);
+        return;
+    }
+
+    // split the top levels here, until there are at least four subtrees a thread
+    int subtree_level = 0;
+    for (int roots = 1; roots < 4 * pool.GetNumThreads(); roots *= 4) {
+        subtree_level++;
+    }
+    subtrees.clear();
+    SplitTop(0, 0, subtree_level);
+
+    // the subtrees are built into their own pools, largest first, each by
+    // whichever thread gets to it next
+    std::stable_sort(subtrees.begin(), subtrees.end(), [&](const Subtree& a, const Subtree& b) {
+        return nodes[a.node].count > nodes[b.node].count;
+    });
+    if (subtree_nodes.size() < subtrees.size()) {
+        subtree_nodes.resize(subtrees.size());
+    }
+    std::atomic<int> next(0);
+    pool.Run([&](int, int) {
+        for (int t = next++; t < static_cast<int>(subtrees.size()); t = next++) {
+            std::vector<Node>& tree_nodes = subtree_nodes[t];
+            tree_nodes.clear();
+            tree_nodes.push_back(nodes[subtrees[t].node]);
+            Subdivide(tree_nodes, 0, subtrees[t].level);
+        }
+    });
+
+    // stitch them in: a subtree's root replaces its node, the rest are
+    // appended, so local index i > 0 becomes first + i - 1
+    int size = nodes.size();
+    for (std::size_t t = 0; t < subtrees.size(); t++) {
+        subtrees[t].first = size;
+        size += subtree_nodes[t].size() - 1;
+    }
+    nodes.resize(size, Node{Quad(0, 0, 0, 0), -1, 0, 0, 0, 0, 0, 0, 0});
+    pool.ParallelFor(0, subtrees.size(), [&](int start, int end) {
+        for (int t = start; t < end; t++) {
+            const std::vector<Node>& tree_nodes = subtree_nodes[t];
+            int first = subtrees[t].first;
+            for (std::size_t i = 0; i < tree_nodes.size(); i++) {
+                Node& node = nodes[i == 0 ? subtrees[t].node : first + i - 1];
+                node = tree_nodes[i];
+                if (node.first_child >= 0) {
+                    node.first_child += first - 1;
+                }
+            }
+        }
+    });
+    CombineTop(0, 0, subtree_level);
+}
+
+void QuadTree::Clear() {
+    nodes.clear();
+    order.clear();
+    outside.clear();
+}
+
+void QuadTree::Update(const Quad& boundary, const ParticleSystem& particles, ThreadPool& pool, double max_moved) {
+
+    // indices that no longer mean the same particles
+    bool same_boundary = boundary.x == this->boundary.x && boundary.y == this->boundary.y && 
+        boundary.width == this->boundary.width && boundary.height == this->boundary.height;
+    if (nodes.empty() || !same_boundary || this->particles != &particles || particles.Size() != num_particles) {
+        Build(boundary, particles, pool);
+        return;
+    }
+
+    leaves.clear();
+    leaf_paths.clear();
+    CollectLeaves(0, 0, 0);
+
+    // flag the particles that left their leaf in place, -1 - index: the top
+    // digits of their key no longer spell the leaf's path
+    thread_counts.assign(pool.GetNumThreads(), 0);
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(leaves.size()) * thread_id / num_threads);
+        int end = static_cast<int>(static_cast<long long>(leaves.size()) * (thread_id + 1) / num_threads);
+        int left = 0;
+        for (int s = start; s < end; s++) {
+            const Node& leaf = nodes[leaves[s]];
+            std::uint64_t path = leaf_paths[s].first;
+            int shift = 2 * (max_depth - leaf_paths[s].second);
+            for (int k = leaf.start; k < leaf.start + leaf.count; k++) {
+                int j = order[k];
+                float x = particles.x[j];
+                float y = particles.y[j];
+                if (!boundary.Contains(Point(x, y)) || (MortonKey(x, y) >> shift) != path) {
+                    order[k] = -1 - j;
+                    left++;
+                }
+            }
+        }
+        thread_counts[thread_id] = left;
+    });
+
+    int left = 0;
+    for (int count : thread_counts) {
+        left += count;
+    }
+    int entered = 0;
+    for (int j : outside) {
+        entered += boundary.Contains(Point(particles.x[j], particles.y[j]));
+    }
+
+    if (left + entered > max_moved * particles.Size()) {
+        Build(boundary, particles, pool);
+        moved_count = left + entered;
+        return;
+    }
+    moved_count = left + entered;
+    rebuilt = false;
+    key_levels = 0; // the relocated particles break the key order
+
+    // where every mover lands, by position in leaves (tree order)
+    arrivals.clear();
+    int kept = 0;
+    for (int j : outside) {
+        if (boundary.Contains(Point(particles.x[j], particles.y[j]))) {
+            arrivals.push_back({0, j});
+        }
+        else {
+            outside[kept++] = j;
+        }
+    }
+    outside.resize(kept);
+    if (left > 0) {
+        for (int& j : order) {
+            if (j < 0) {
+                j = -1 - j;
+                if (boundary.Contains(Point(particles.x[j], particles.y[j]))) {
+                    arrivals.push_back({0, j});
+                }
+                else {
+                    outside.push_back(j);
+                }
+                j = -1;
+            }
+        }
+    }
+    leaf_positions.resize(nodes.size());
+    for (int s = 0; s < static_cast<int>(leaves.size()); s++) {
+        leaf_positions[leaves[s]] = s;
+    }
+    for (std::pair<int, int>& arrival : arrivals) {
+        arrival.first = leaf_positions[Locate(particles.x[arrival.second], particles.y[arrival.second])];
+    }
+    std::sort(arrivals.begin(), arrivals.end());
+
+    // every leaf keeps the particles that stayed, then takes its arrivals
+    scratch.resize(order.size() - left + arrivals.size());
+    int cursor = 0;
+    std::size_t a = 0;
+    for (int s = 0; s < static_cast<int>(leaves.size()); s++) {
+        Node& leaf = nodes[leaves[s]];
+        int start = cursor;
+        for (int k = leaf.start; k < leaf.start + leaf.count; k++) {
+            if (order[k] >= 0) {
+                scratch[cursor++] = order[k];
+            }
+        }
+        for (; a < arrivals.size() && arrivals[a].first == s; a++) {
+            scratch[cursor++] = arrivals[a].second;
+        }
+        leaf.start = start;
+        leaf.count = cursor - start;
+    }
+    std::swap(order, scratch);
+    scratch.resize(order.size());
+
+    // the leaves are most of the work and independent, the rest of the
+    // aggregates follow bottom up along with the splits and merges
+    pool.ParallelFor(0, leaves.size(), [&](int start, int end) {
+        for (int s = start; s < end; s++) {
+            LeafAggregates(nodes[leaves[s]]);
+        }
+    });
+    Refit(0, 0);
+}
+
+int QuadTree::Locate(float x, float y) const {
+
+    std::uint32_t cell_x = CellX(x);
+    std::uint32_t cell_y = CellY(y);
+    int node_index = 0;
+    for (int shift = max_depth - 1; nodes[node_index].first_child >= 0; shift--) {
+        int quadrant = ((cell_y >> shift) & 1) * 2 + ((cell_x >> shift) & 1);
+        node_index = nodes[node_index].first_child + quadrant;
+    }
+
+    return node_index;
+}
+
+void QuadTree::CollectLeaves(int node_index, int level, std::uint64_t path) {
+
+    const Node& node = nodes[node_index];
+    if (node.first_child < 0) {
+        leaves.push_back(node_index);
+        leaf_paths.push_back({path, level});
+        return;
+    }
+
+    for (int c = 0; c < 4; c++) {
+        CollectLeaves(node.first_child + c, level + 1, 4 * path + c);
+    }
+}
+
+void QuadTree::Refit(int node_index, int level) {
+
+    // leaves have their aggregates already, the ones that overflowed split
+    if (nodes[node_index].first_child < 0) {
+        if (!IsLeaf(nodes[node_index], level)) {
+            Subdivide(nodes, node_index, level);
+        }
+        return;
     }
 
-    if (points.size() < capacity) {
-        points.push_back(point);
-        return true;
+    int first_child = nodes[node_index].first_child;
+    int count = 0;
+    for (int c = first_child; c < first_child + 4; c++) {
+        Refit(c, level + 1);
+        count += nodes[c].count;
+    }
+
+    // the leaves are in tree order, so the first child's range starts the node's
+    Node& node = nodes[node_index];
+    node.start = nodes[first_child].start;
+    node.count = count;
+
+    // few enough particles left to merge back into one leaf
+    if (count <= capacity) {
+        node.first_child = -1;
+        LeafAggregates(node);
+        FreeChildren(first_child);
+        return;
+    }
+
+    CombineChildren(nodes, node_index);
+}
+
+int QuadTree::AllocateChildren(std::vector<Node>& tree_nodes) {
+
+    // only the shared pool has blocks freed by merges
+    if (&tree_nodes == &nodes && !free_blocks.empty()) {
+        int first_child = free_blocks.back();
+        free_blocks.pop_back();
+        return first_child;
+    }
+
+    tree_nodes.resize(tree_nodes.size() + 4, Node{Quad(0, 0, 0, 0), -1, 0, 0, 0, 0, 0, 0, 0});
+    return tree_nodes.size() - 4;
+}
+
+void QuadTree::FreeChildren(int first_child) {
+
+    for (int c = first_child; c < first_child + 4; c++) {
+        if (nodes[c].first_child >= 0) {
+            FreeChildren(nodes[c].first_child);
+        }
+    }
+    free_blocks.push_back(first_child);
+}
+
+void QuadTree::Partition(const Node& node, int level, int child_start[4], int counts[4]) {
+
+    int start = node.start;
+    int end = node.start + node.count;
+
+    std::fill(counts, counts + 4, 0);
+    if (key_levels > 0) {
+        // sorted by key, the keys of the range share everything above this
+        // level's digit, so each child is the run of one digit
+        int shift = 2 * (key_levels - 1 - level);
+        for (int c = 0; c < 4; c++) {
+            child_start[c] = std::partition_point(keys.begin() + start, keys.begin() + end, [&](std::uint64_t key) {
+                return static_cast<int>((key >> shift) & 3) < c;
+            }) - keys.begin();
+        }
+        for (int c = 0; c < 4; c++) {
+            counts[c] = ((c < 3) ? child_start[c + 1] : end) - child_start[c];
+        }
     }
     else {
-        if (!divided) {
-            Subdivide();
+        // counting sort of the node's range into nw, ne, sw, se
+        for (int k = start; k < end; k++) {
+            counts[Quadrant(order[k], level)]++;
+        }
+        int offsets[4] = {start, start + counts[0], start + counts[0] + counts[1], start + counts[0] + counts[1] + counts[2]};
+        std::copy(offsets, offsets + 4, child_start);
+        for (int k = start; k < end; k++) {
+            scratch[offsets[Quadrant(order[k], level)]++] = order[k];
+        }
+        std::copy(scratch.begin() + start, scratch.begin() + end, order.begin() + start);
+    }
+}
+
+int QuadTree::AddChildren(std::vector<Node>& tree_nodes, int node_index, const int child_start[4], const int counts[4]) {
+
+    // a copy, the pool may reallocate while the children are added
+    Quad quad = tree_nodes[node_index].boundary;
+    float x = quad.x;
+    float y = quad.y;
+    float w = quad.width / 2;
+    float h = quad.height / 2;
+
+    int first_child = AllocateChildren(tree_nodes);
+    tree_nodes[node_index].first_child = first_child;
+    tree_nodes[first_child] = Node{Quad(x, y, w, h), -1, child_start[0], counts[0], 0, 0, 0, 0, 0};             // nw
+    tree_nodes[first_child + 1] = Node{Quad(x + w, y, w, h), -1, child_start[1], counts[1], 0, 0, 0, 0, 0};     // ne
+    tree_nodes[first_child + 2] = Node{Quad(x, y + h, w, h), -1, child_start[2], counts[2], 0, 0, 0, 0, 0};     // sw
+    tree_nodes[first_child + 3] = Node{Quad(x + w, y + h, w, h), -1, child_start[3], counts[3], 0, 0, 0, 0, 0}; // se
+    return first_child;
+}
+
+bool QuadTree::IsLeaf(const Node& node, int level) const {
+    // a bucket at the bottom keeps whatever lands in it
+    return node.count <= capacity || level >= max_depth;
+}
+
+void QuadTree::Subdivide(std::vector<Node>& tree_nodes, int node_index, int level) {
+
+    if (IsLeaf(tree_nodes[node_index], level)) {
+        LeafAggregates(tree_nodes[node_index]);
+        return;
+    }
+
+    int child_start[4];
+    int counts[4];
+    Partition(tree_nodes[node_index], level, child_start, counts);
+    int first_child = AddChildren(tree_nodes, node_index, child_start, counts);
+
+    for (int c = 0; c < 4; c++) {
+        Subdivide(tree_nodes, first_child + c, level + 1);
+    }
+
+    CombineChildren(tree_nodes, node_index);
+}
+
+void QuadTree::SplitTop(int node_index, int level, int subtree_level) {
+
+    if (level == subtree_level || IsLeaf(nodes[node_index], level)) {
+        subtrees.push_back(Subtree{node_index, level, 0});
+        return;
+    }
+
+    int child_start[4];
+    int counts[4];
+    Partition(nodes[node_index], level, child_start, counts);
+    int first_child = AddChildren(nodes, node_index, child_start, counts);
+
+    for (int c = 0; c < 4; c++) {
+        SplitTop(first_child + c, level + 1, subtree_level);
+    }
+}
+
+void QuadTree::CombineTop(int node_index, int level, int subtree_level) {
+
+    // subtree roots come with their aggregates
+    if (level == subtree_level || nodes[node_index].first_child < 0) {
+        return;
+    }
+
+    for (int c = nodes[node_index].first_child; c < nodes[node_index].first_child + 4; c++) {
+        CombineTop(c, level + 1, subtree_level);
+    }
+    CombineChildren(nodes, node_index);
+}
+
+void QuadTree::LeafAggregates(Node& node) const {
+
+    node.mass = 0;
+    node.abs_mass = 0;
+    node.com_x = 0;
+    node.com_y = 0;
+    node.max_size = 0;
+    for (int k = node.start; k < node.start + node.count; k++) {
+        int j = order[k];
+        double particle_abs_mass = std::abs(particles->mass[j]);
+        node.mass += particles->mass[j];
+        node.abs_mass += particle_abs_mass;
+        node.com_x += particles->x[j] * particle_abs_mass;
+        node.com_y += particles->y[j] * particle_abs_mass;
+        node.max_size = std::max(node.max_size, static_cast<double>(particles->radius[j]));
+    }
+    if (node.abs_mass > 0) {
+        node.com_x /= node.abs_mass;
+        node.com_y /= node.abs_mass;
+    }
+}
+
+void QuadTree::CombineChildren(std::vector<Node>& tree_nodes, int node_index) {
+
+    // the aggregates of a node combine its children's
+    Node& parent = tree_nodes[node_index];
+    parent.mass = 0;
+    parent.abs_mass = 0;
+    parent.com_x = 0;
+    parent.com_y = 0;
+    parent.max_size = 0;
+    for (int c = parent.first_child; c < parent.first_child + 4; c++) {
+        const Node& child = tree_nodes[c];
+        parent.mass += child.mass;
+        parent.abs_mass += child.abs_mass;
+        parent.com_x += child.com_x * child.abs_mass;
+        parent.com_y += child.com_y * child.abs_mass;
+        parent.max_size = std::max(parent.max_size, child.max_size);
+    }
+    if (parent.abs_mass > 0) {
+        parent.com_x /= parent.abs_mass;
+        parent.com_y /= parent.abs_mass;
+    }
+}
+
+void QuadTree::AccumulateAccel(int node_index, int index, double theta, double& accel_x, double& accel_y) const {
+
+    const Node& node = nodes[node_index];
+    if (node.abs_mass == 0) {
+        return;
+    }
+
+    double pos_x = particles->x[index];
+    double pos_y = particles->y[index];
+    double size = particles->radius[index];
+    Point point(pos_x, pos_y);
+
+    // far enough away, treat the whole node as one body at its center of mass
+    double d_x = node.com_x - pos_x;
+    double d_y = node.com_y - pos_y;
+    double factor;
+
+    if (!node.boundary.Contains(point) && node.boundary.width * node.boundary.width < theta * theta * (d_x * d_x + d_y * d_y)) {
+        if (GravityFactor(d_x, d_y, size + node.max_size, factor)) {
+            accel_x += factor * node.mass * d_x;
+            accel_y += factor * node.mass * d_y;
+        }
+        return;
+    }
+
+    // otherwise open the node, the particles of a leaf interact directly
+    if (node.first_child < 0) {
+        for (int k = node.start; k < node.start + node.count; k++) {
+            int j = order[k];
+            if (j == index) {
+                continue;
+            }
+
+            d_x = particles->x[j] - pos_x;
+            d_y = particles->y[j] - pos_y;
+            if (GravityFactor(d_x, d_y, size + particles->radius[j], factor)) {
+                accel_x += factor * particles->mass[j] * d_x;
+                accel_y += factor * particles->mass[j] * d_y;
+            }
+        }
+        return;
+    }
+
+    for (int c = node.first_child; c < node.first_child + 4; c++) {
+        AccumulateAccel(c, index, theta, accel_x, accel_y);
+    }
+}
+
+void QuadTree::CalcAccel(int index, double theta, float& accel_x, float& accel_y) const {
+
+    double sum_x = 0;
+    double sum_y = 0;
+    if (!nodes.empty()) {
+        AccumulateAccel(0, index, theta, sum_x, sum_y);
+    }
+
+    // the few particles outside the root, which also need the direct sum
+    // for themselves: the traversal only gives them the inside's pull
+    for (int j : outside) {
+        if (j == index) {
+            continue;
+        }
+
+        double d_x = particles->x[j] - particles->x[index];
+        double d_y = particles->y[j] - particles->y[index];
+        double factor;
+        if (GravityFactor(d_x, d_y, particles->radius[index] + particles->radius[j], factor)) {
+            sum_x += factor * particles->mass[j] * d_x;
+            sum_y += factor * particles->mass[j] * d_y;
+        }
+    }
+
+    accel_x = sum_x;
+    accel_y = sum_y;
+}
+
+void QuadTree::Query(int node_index, const Quad& range, std::vector<int>& found) const {
+
+    const Node& node = nodes[node_index];
+    if (node.count == 0 || !range.Intersects(node.boundary)) {
+        return;
+    }
+
+    // the whole subtree is one contiguous range of order
+    if (range.Contains(node.boundary)) {
+        found.insert(found.end(), order.begin() + node.start, order.begin() + node.start + node.count);
+        return;
+    }
+
+    if (node.first_child < 0) {
+        for (int k = node.start; k < node.start + node.count; k++) {
+            int j = order[k];
+            if (range.Contains(Point(particles->x[j], particles->y[j]))) {
+                found.push_back(j);
+            }
         }
+        return;
+    }
 
-        if (ne->Insert(point)) return true;
-        if (nw->Insert(point)) return true;
-        if (se->Insert(point)) return true;
-        if (sw->Insert(point)) return true;
+    for (int c = node.first_child; c < node.first_child + 4; c++) {
+        Query(c, range, found);
     }
+}
 
-    return false;
+void QuadTree::Query(const Quad& range, std::vector<int>& found) const {
+    if (!nodes.empty()) {
+        Query(0, range, found);
+    }
 }
 
-void QuadTree::Draw(raylib::Camera2D cam) const {
+void QuadTree::Draw(int node_index, raylib::Camera2D cam, const Quad& view) const {
+
+    const Node& node = nodes[node_index];
+    if (!view.Intersects(node.boundary)) {
+        return;
+    }
 
-    Rectangle rect = {boundary.x, boundary.y, 
-        boundary.width, boundary.height};
-    if (!is_master) {
+    Rectangle rect = {node.boundary.x, node.boundary.y, 
+        node.boundary.width, node.boundary.height};
+    if (node_index != 0) {
         DrawRectangleLinesEx(rect, 1 / cam.zoom, raylib::Color(0, 255, 0, 255 / 12));
     }
     else {
         DrawRectangleLinesEx(rect, 1 / cam.zoom, raylib::Color(255, 0, 0, 255));
     }
 
-    if (ne) ne->Draw(cam);
-    if (nw) nw->Draw(cam);
-    if (se) se->Draw(cam);
-    if (sw) sw->Draw(cam);
+    // children under a pixel would only fill the node in
+    if (node.first_child < 0 || node.boundary.width * cam.zoom < 2) {
+        return;
+    }
+
+    for (int c = node.first_child; c < node.first_child + 4; c++) {
+        Draw(c, cam, view);
+    }
+}
+
+void QuadTree::Draw(raylib::Camera2D cam, const Quad& view) const {
+    if (!nodes.empty()) {
+        Draw(0, cam, view);
+    }
+}
+
+bool QuadTree::IsEmpty() const {
+    return nodes.empty() || nodes[0].count == 0;
 }
 
 const Quad& QuadTree::GetBoundary() const {
     return boundary;
+}
+
+double QuadTree::GetMaxSize() const {
+    return nodes.empty() ? 0.0 : nodes[0].max_size;
+}
+
+int QuadTree::GetNodeCount() const {
+    return nodes.size() - 4 * free_blocks.size();
+}
+
+int QuadTree::GetOutsideCount() const {
+    return outside.size();
+}
+
+int QuadTree::GetCapacity() const {
+    return capacity;
+}
+
+int QuadTree::GetMaxDepth() const {
+    return max_depth;
+}
+
+int QuadTree::GetMovedCount() const {
+    return moved_count;
+}
+
+bool QuadTree::WasRebuilt() const {
+    return rebuilt;
 }
\ No newline at end of file
@@ -0,0 +1,653 @@
+#include "simulation.hpp"
+#include "gravity.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+
+void mt_CalcParticleAccelsBarnesHut(ParticleSystem& particles, const QuadTree& quad_tree, double theta, int start, int end) {
+    for (int i = start; i < end; i++) {
+        // each thread only writes the accelerations of its own range
+        quad_tree.CalcAccel(i, theta, particles.ax[i], particles.ay[i]);
+    }
+}
+
+// velocity Verlet position update x += v dt + a dt^2 / 2, keeping a for the velocity update
+void mt_VerletPositions(ParticleSystem& particles, float* prev_ax, float* prev_ay, double dt, int start, int end) {
+    for (int i = start; i < end; i++) {
+        particles.x[i] += (particles.vx[i] + 0.5 * particles.ax[i] * dt) * dt;
+        particles.y[i] += (particles.vy[i] + 0.5 * particles.ay[i] * dt) * dt;
+        prev_ax[i] = particles.ax[i];
+        prev_ay[i] = particles.ay[i];
+    }
+}
+
+// velocity Verlet velocity update v += (a_old + a_new) dt / 2
+void mt_VerletVelocities(ParticleSystem& particles, const float* prev_ax, const float* prev_ay, double dt, int start, int end) {
+    for (int i = start; i < end; i++) {
+        particles.vx[i] += 0.5 * (prev_ax[i] + particles.ax[i]) * dt;
+        particles.vy[i] += 0.5 * (prev_ay[i] + particles.ay[i]) * dt;
+    }
+}
+
+// opening half kick of every particle in [start, end) whose block step starts at substep
+void mt_OpeningKicks(ParticleSystem& particles, int substep, int num_substeps, double dt_min, int start, int end) {
+    for (int i = start; i < end; i++) {
+        int span = num_substeps >> particles.level[i]; // substeps per step of this particle
+        if (substep % span == 0) {
+            particles.vx[i] += particles.ax[i] * 0.5 * dt_min * span;
+            particles.vy[i] += particles.ay[i] * 0.5 * dt_min * span;
+        }
+    }
+}
+
+// spreads the 16 low bits of v over the even bits
+static std::uint32_t SpreadBits(std::uint32_t v) {
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Morton key of every particle in [start, end) on a 2^16 grid over the box, with its index in the low half
+void mt_ReorderKeys(const ParticleSystem& particles, const Quad& box, std::uint64_t* keys, int start, int end) {
+    for (int i = start; i < end; i++) {
+        float u = std::clamp((particles.x[i] - box.x) / box.width * 65536.0f, 0.0f, 65535.0f);
+        float v = std::clamp((particles.y[i] - box.y) / box.height * 65536.0f, 0.0f, 65535.0f);
+        std::uint64_t key = SpreadBits(static_cast<std::uint32_t>(u)) | (SpreadBits(static_cast<std::uint32_t>(v)) << 1);
+        keys[i] = (key << 32) | static_cast<std::uint32_t>(i);
+    }
+}
+
+// disorder (in levels) at which the particles are sorted, in both modes.
+// Adaptive, the interval also doubles under half of it and halves above twice it
+static const double reorder_disorder = 1.0;
+static const int max_reorder_interval = 1024;
+
+// moves every particle in [start, end) back into the box by whole box widths
+void mt_WrapPositions(ParticleSystem& particles, const Quad& box, int start, int end) {
+    for (int i = start; i < end; i++) {
+        particles.x[i] -= box.width * std::floor((particles.x[i] - box.x) / box.width);
+        particles.y[i] -= box.height * std::floor((particles.y[i] - box.y) / box.height);
+    }
+}
+
+const char* ForceSolverName(ForceSolver solver) {
+    switch (solver) {
+        case ForceSolver::BarnesHut: return "Barnes-Hut";
+        case ForceSolver::FastMultipole: return "FMM";
+        case ForceSolver::ParticleMesh: return "PM";
+        default: return "exact";
+    }
+}
+
+const char* IntegratorName(Integrator integrator) {
+    switch (integrator) {
+        case Integrator::Leapfrog: return "leapfrog";
+        case Integrator::VelocityVerlet: return "verlet";
+        default: return "euler";
+    }
+}
+
+Simulation::Simulation(const Quad &boundary, double dt, int num_threads, unsigned seed) :
+    pool(num_threads),
+    quad_tree(16),
+    boundary(boundary),
+    tree_bounds(0, 0, 0, 0),
+    periodic(false),
+    solver(ForceSolver::Exact),
+    theta(0.5),
+    tree_rebuild_fraction(0.1),
+    particles_renumbered(true),
+    integrator(Integrator::Euler),
+    dt(dt),
+    accel_count(0),
+    max_level(0),
+    eta(0.05),
+    force_evals(0),
+    reorder_interval(8),
+    adaptive_reorder(true),
+    steps_since_reorder(0),
+    disorder(0),
+    sorted_height(0),
+    reordered(false),
+    step_count(0),
+    step_ms(0),
+    gen(seed) {}
+
+void Simulation::SpawnSpiral(float center_x, float center_y, int square_dim, int spacing) {
+
+    std::uniform_real_distribution<double> distribution(-400.0, 400.0);
+
+    for(int i = center_x - square_dim / 2; i < center_x + square_dim / 2; i += spacing) {
+        for(int j = center_y - square_dim / 2; j < center_y + square_dim / 2; j += spacing) {
+
+            // assign each particle a random speed
+            double vel_x = distribution(gen) / 10;
+            double vel_y = distribution(gen) / 10;
+
+            // assign velocities according to a spiral shape
+            double delta_x = center_x - i;
+            double delta_y = center_y - j;
+            vel_x += 0.5 * delta_y;
+            vel_y += -0.5 * delta_x;
+
+            particles.Add(i, j, vel_x, vel_y);
+        }
+    }
+}
+
+void Simulation::BuildTree() {
+
+    if (solver != ForceSolver::BarnesHut) {
+        quad_tree.Clear();
+        return;
+    }
+
+    // The root is the core square of the particles (see CoreSquare) with a
+    // quarter of headroom, kept while no more than a few particles are
+    // outside it and the rest don't fit in half of it, so the tree can be
+    // updated in between (a new root rebuilds it). The ones outside are
+    // summed directly
+    int num_outside;
+    Quad inside = BoundingSquare(particles, tree_bounds, num_outside, pool);
+    if (num_outside > MAX_OUTSIDE || num_outside == static_cast<int>(particles.Size()) || inside.width < 0.5f * tree_bounds.width) {
+        Quad bounds = CoreSquare(particles, pool);
+        float width = 1.25f * bounds.width;
+        tree_bounds = Quad(bounds.x + 0.5f * (bounds.width - width), bounds.y + 0.5f * (bounds.width - width), width, width);
+    }
+
+    // the tree of the last pass follows the particles unless too many of
+    // them changed leaf, the node pool is reused either way
+    if (particles_renumbered) {
+        quad_tree.Build(tree_bounds, particles, pool);
+        particles_renumbered = false;
+    }
+    else {
+        quad_tree.Update(tree_bounds, particles, pool, tree_rebuild_fraction);
+    }
+}
+
+double Simulation::SplitHeight() {
+
+    // levels above the bottom of the 2^16 grid at which the keys of
+    // neighbours in memory part, on average: about log2 of how far apart they are
+    int n = particles.Size();
+    std::vector<double> heights(pool.GetNumThreads(), 0.0);
+    pool.Run([&](int thread_id, int num_threads) {
+        int start = static_cast<int>(static_cast<long long>(n) * thread_id / num_threads);
+        int end = std::min(n - 1, static_cast<int>(static_cast<long long>(n) * (thread_id + 1) / num_threads));
+        long long sum = 0;
+        for (int i = start; i < end; i++) {
+            sum += std::bit_width((reorder_keys[i] ^ reorder_keys[i + 1]) >> 32);
+        }
+        heights[thread_id] = 0.5 * sum;
+    });
+
+    return std::accumulate(heights.begin(), heights.end(), 0.0) / std::max(1, n - 1);
+}
+
+void Simulation::Reorder() {
+
+    reordered = false;
+    if (reorder_interval == 0 || ++steps_since_reorder < reorder_interval) {
+        return;
+    }
+    steps_since_reorder = 0;
+
+    // keys over the core square, the few particles outside clamp to its edge
+    int n = particles.Size();
+    Quad box = CoreSquare(particles, pool);
+    reorder_keys.resize(n);
+    pool.ParallelFor(0, n, [&](int start, int end) {
+        mt_ReorderKeys(particles, box, reorder_keys.data(), start, end);
+    });
+
+    // measured against the order right after the last sort, in units of
+    // length so a box that grew or shrank in between doesn't count
+    disorder = std::max(0.0, SplitHeight() + std::log2(box.width) - sorted_height);
+
+    if (adaptive_reorder) {
+        if (disorder < 0.5 * reorder_disorder) {
+            reorder_interval = std::min(max_reorder_interval, 2 * reorder_interval);
+        }
+        else if (disorder > 2 * reorder_disorder) {
+            reorder_interval = std::max(1, reorder_interval / 2);
+        }
+    }
+
+    if (disorder >= reorder_disorder) {
+        SortByKeys(box);
+    }
+}
+
+void Simulation::SortParticles() {
+
+    int n = particles.Size();
+    Quad box = CoreSquare(particles, pool);
+    reorder_keys.resize(n);
+    pool.ParallelFor(0, n, [&](int start, int end) {
+        mt_ReorderKeys(particles, box, reorder_keys.data(), start, end);
+    });
+
+    SortByKeys(box);
+}
+
+void Simulation::SortByKeys(const Quad& box) {
+
+    int n = particles.Size();
+
+    // the index in the low half breaks ties, so equal keys keep their order
+    std::sort(reorder_keys.begin(), reorder_keys.end());
+    sorted_height = SplitHeight() + std::log2(box.width);
+    reorder_order.resize(n);
+    for (int k = 0; k < n; k++) {
+        reorder_order[k] = static_cast<int>(reorder_keys[k] & 0xffffffff);
+    }
+    reorder_buffer.Resize(n);
+    pool.ParallelFor(0, n, [&](int start, int end) {
+        reorder_buffer.Gather(particles, reorder_order.data(), start, end);
+    });
+    reorder_buffer.next_id = particles.next_id;
+    std::swap(particles, reorder_buffer);
+
+    // accelerations moved with their particles, they're only still usable if everyone had one
+    if (accel_count != particles.Size()) {
+        accel_count = 0;
+    }
+    particles_renumbered = true;
+    reordered = true;
+}
+
+void Simulation::CalcAccels() {
+
+    BuildTree();
+
+    // Reset acceleration for all particles to zero before the force pass
+    pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+        particles.ResetAccels(start, end);
+    });
+
+    // Calculate particle accelerations in parallel
+    if (solver == ForceSolver::BarnesHut) {
+        pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+            mt_CalcParticleAccelsBarnesHut(particles, quad_tree, theta, start, end);
+        });
+    }
+    else if (solver == ForceSolver::FastMultipole) {
+        fast_multipole.CalcAccels(particles, pool);
+    }
+    else if (solver == ForceSolver::ParticleMesh) {
+        particle_mesh.CalcAccels(particles, pool);
+    }
+    else {
+        direct_sum.CalcAccels(particles, pool);
+    }
+
+    accel_count = particles.Size();
+    force_evals += particles.Size();
+}
+
+void Simulation::CalcActiveAccels() {
+
+    // everyone is due, the halved pass is cheaper
+    if (active.size() == particles.Size()) {
+        CalcAccels();
+        return;
+    }
+
+    if (solver == ForceSolver::BarnesHut) {
+        BuildTree();
+        pool.ParallelFor(0, active.size(), [&](int start, int end) {
+            for (int k = start; k < end; k++) {
+                quad_tree.CalcAccel(active[k], theta, particles.ax[active[k]], particles.ay[active[k]]);
+            }
+        });
+    }
+    else if (solver == ForceSolver::FastMultipole) {
+        fast_multipole.CalcActiveAccels(particles, active, pool);
+    }
+    else if (solver == ForceSolver::ParticleMesh) {
+        particle_mesh.CalcActiveAccels(particles, active, pool);
+    }
+    else {
+        direct_sum.CalcActiveAccels(particles, active, pool);
+    }
+
+    force_evals += active.size();
+}
+
+int Simulation::PickLevel(int index, int substep) const {
+
+    int num_substeps = 1 << max_level;
+    int level = 0;
+
+    // the cutoff length 20 * (size_i + size_j) for a pair of equal particles
+    // is the smallest scale the force resolves
+    double accel = std::hypot(particles.ax[index], particles.ay[index]);
+    if (accel > 0) {
+        double wanted_dt = eta * std::sqrt(40 * particles.radius[index] / accel);
+        while (level < max_level && dt / (1 << level) > wanted_dt) {
+            level++;
+        }
+    }
+
+    // a particle can only move to a coarser level on a substep that level steps on
+    while (substep % (num_substeps >> level) != 0) {
+        level++;
+    }
+
+    return level;
+}
+
+void Simulation::BlockStep() {
+
+    int num_substeps = 1 << max_level;
+    double dt_min = dt / num_substeps;
+
+    // forces for everyone and fresh levels, everything is synchronized at substep 0
+    if (accel_count != particles.Size()) {
+        CalcAccels();
+        pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+            for (int i = start; i < end; i++) {
+                particles.level[i] = PickLevel(i, 0);
+            }
+        });
+    }
+
+    for (int substep = 0; substep < num_substeps; substep++) {
+        // particles starting a step kick, then everyone drifts so positions stay synchronized
+        pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+            mt_OpeningKicks(particles, substep, num_substeps, dt_min, start, end);
+            particles.Drift(dt_min, start, end);
+        });
+
+        // particles whose step ends on the next substep get new forces and their closing kick
+        active.clear();
+        for (std::size_t i = 0; i < particles.Size(); i++) {
+            if ((substep + 1) % (num_substeps >> particles.level[i]) == 0) {
+                active.push_back(i);
+            }
+        }
+        if (active.empty()) {
+            continue;
+        }
+
+        CalcActiveAccels();
+        pool.ParallelFor(0, active.size(), [&](int start, int end) {
+            for (int k = start; k < end; k++) {
+                int i = active[k];
+                double half_dt = 0.5 * dt_min * (num_substeps >> particles.level[i]);
+                particles.vx[i] += particles.ax[i] * half_dt;
+                particles.vy[i] += particles.ay[i] * half_dt;
+                particles.level[i] = PickLevel(i, substep + 1);
+            }
+        });
+    }
+}
+
+void Simulation::Step() {
+
+    auto step_start = std::chrono::steady_clock::now();
+    force_evals = 0;
+
+    if (periodic) {
+        // wrap positions back into the box, nobody is lost
+        pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+            mt_WrapPositions(particles, boundary, start, end);
+        });
+    }
+
+    Reorder();
+
+    if (max_level > 0) {
+        BlockStep();
+    }
+    else if (integrator == Integrator::Euler) {
+        // v += a(x) dt, then x += v dt
+        CalcAccels();
+        pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+            particles.Kick(dt, start, end);
+            particles.Drift(dt, start, end);
+        });
+        accel_count = 0; // the positions moved on since
+    }
+    else {
+        // a(x) is left over from the end of the previous step unless
+        // particles were added (or the solver changed) since
+        if (accel_count != particles.Size()) {
+            CalcAccels();
+        }
+
+        if (integrator == Integrator::Leapfrog) {
+            // half kick, full drift, then the closing half kick with the new a(x)
+            pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+                particles.Kick(0.5 * dt, start, end);
+                particles.Drift(dt, start, end);
+            });
+            CalcAccels();
+            pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+                particles.Kick(0.5 * dt, start, end);
+            });
+        }
+        else {
+            prev_ax.resize(particles.Size());
+            prev_ay.resize(particles.Size());
+            pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+                mt_VerletPositions(particles, prev_ax.data(), prev_ay.data(), dt, start, end);
+            });
+            CalcAccels();
+            pool.ParallelFor(0, particles.Size(), [&](int start, int end) {
+                mt_VerletVelocities(particles, prev_ax.data(), prev_ay.data(), dt, start, end);
+            });
+        }
+    }
+
+    step_count++;
+    step_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - step_start).count();
+}
+
+void Simulation::Clear() {
+    particles.Clear();
+    accel_count = 0;
+    particles_renumbered = true;
+}
+
+double Simulation::CalcPotentialEnergy() {
+
+    int n = particles.Size();
+    std::vector<double> partial_sums(pool.GetNumThreads(), 0.0);
+
+    // rows are dealt out round robin so every thread gets a similar share of the triangle
+    pool.Run([&](int thread_id, int num_threads) {
+        double sum = 0;
+        for (int i = thread_id; i < n; i += num_threads) {
+            double sum_i = 0;
+            for (int j = i + 1; j < n; j++) {
+                sum_i += particles.mass[j] * PairPotential(particles.x[j] - particles.x[i], particles.y[j] - particles.y[i], 
+                    particles.radius[i] + particles.radius[j]);
+            }
+            sum += particles.mass[i] * sum_i;
+        }
+        partial_sums[thread_id] = sum;
+    });
+
+    return std::accumulate(partial_sums.begin(), partial_sums.end(), 0.0);
+}
+
+bool Simulation::WriteSnapshot(const std::string& path) const {
+
+    std::ofstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    file << "id,x,y,vx,vy,mass\n";
+    for (std::size_t i = 0; i < particles.Size(); i++) {
+        file << particles.id[i] << ',' << particles.x[i] << ',' << particles.y[i] << ',' 
+             << particles.vx[i] << ',' << particles.vy[i] << ',' 
+             << particles.mass[i] << '\n';
+    }
+
+    return static_cast<bool>(file);
+}
+
+ParticleSystem& Simulation::GetParticles() {
+    return particles;
+}
+
+const ParticleSystem& Simulation::GetParticles() const {
+    return particles;
+}
+
+DirectSum& Simulation::GetDirectSum() {
+    return direct_sum;
+}
+
+FastMultipole& Simulation::GetFastMultipole() {
+    return fast_multipole;
+}
+
+ParticleMesh& Simulation::GetParticleMesh() {
+    return particle_mesh;
+}
+
+const QuadTree* Simulation::GetQuadTree() const {
+    return &quad_tree;
+}
+
+const Quad& Simulation::GetBoundary() const {
+    return boundary;
+}
+
+const Quad& Simulation::GetTreeBounds() const {
+    return tree_bounds;
+}
+
+SimulationStats Simulation::GetStats() const {
+
+    SimulationStats stats = {};
+    stats.step = step_count;
+    stats.time = step_count * dt;
+    stats.num_particles = particles.Size();
+    stats.step_ms = step_ms;
+    stats.force_evals = force_evals;
+    stats.tree_moved = (solver == ForceSolver::BarnesHut) ? quad_tree.GetMovedCount() : 0;
+    stats.tree_rebuilt = (solver == ForceSolver::BarnesHut) && quad_tree.WasRebuilt();
+    stats.disorder = disorder;
+    stats.reorder_interval = reorder_interval;
+    stats.reordered = reordered;
+
+    for (std::size_t i = 0; i < particles.Size(); i++) {
+        double m = particles.mass[i];
+        stats.total_mass += m;
+        stats.kinetic_energy += 0.5 * std::abs(m) * (particles.vx[i] * particles.vx[i] + particles.vy[i] * particles.vy[i]);
+        stats.momentum_x += m * particles.vx[i];
+        stats.momentum_y += m * particles.vy[i];
+    }
+
+    return stats;
+}
+
+void Simulation::SetSolver(ForceSolver solver) {
+    this->solver = solver;
+    accel_count = 0;
+}
+
+ForceSolver Simulation::GetSolver() const {
+    return solver;
+}
+
+void Simulation::SetTheta(double theta) {
+    this->theta = theta;
+}
+
+double Simulation::GetTheta() const {
+    return theta;
+}
+
+void Simulation::SetTreeLeafSize(int leaf_size) {
+    quad_tree = QuadTree(std::max(1, leaf_size), quad_tree.GetMaxDepth());
+    particles_renumbered = true;
+}
+
+int Simulation::GetTreeLeafSize() const {
+    return quad_tree.GetCapacity();
+}
+
+void Simulation::SetTreeMaxDepth(int max_depth) {
+    quad_tree = QuadTree(quad_tree.GetCapacity(), max_depth);
+    particles_renumbered = true;
+}
+
+int Simulation::GetTreeMaxDepth() const {
+    return quad_tree.GetMaxDepth();
+}
+
+void Simulation::SetTreeRebuildFraction(double tree_rebuild_fraction) {
+    this->tree_rebuild_fraction = std::clamp(tree_rebuild_fraction, 0.0, 1.0);
+}
+
+double Simulation::GetTreeRebuildFraction() const {
+    return tree_rebuild_fraction;
+}
+
+void Simulation::SetReorderInterval(int reorder_interval) {
+    this->reorder_interval = std::clamp(reorder_interval, 0, max_reorder_interval);
+    steps_since_reorder = 0;
+}
+
+int Simulation::GetReorderInterval() const {
+    return reorder_interval;
+}
+
+void Simulation::SetAdaptiveReorder(bool adaptive_reorder) {
+    this->adaptive_reorder = adaptive_reorder;
+}
+
+bool Simulation::IsAdaptiveReorder() const {
+    return adaptive_reorder;
+}
+
+void Simulation::SetIntegrator(Integrator integrator) {
+    this->integrator = integrator;
+}
+
+Integrator Simulation::GetIntegrator() const {
+    return integrator;
+}
+
+void Simulation::SetBlockLevels(int max_level) {
+    this->max_level = std::clamp(max_level, 0, 16);
+    accel_count = 0; // levels have to be picked again
+}
+
+int Simulation::GetBlockLevels() const {
+    return max_level;
+}
+
+void Simulation::SetTimestepAccuracy(double eta) {
+    this->eta = eta;
+}
+
+double Simulation::GetTimestepAccuracy() const {
+    return eta;
+}
+
+double Simulation::GetDt() const {
+    return dt;
+}
+
+void Simulation::SetPeriodic(bool periodic) {
+    this->periodic = periodic;
+    particle_mesh.SetPeriodic(periodic, boundary);
+    accel_count = 0;
+}
+
+bool Simulation::IsPeriodic() const {
+    return periodic;
+}
\ No newline at end of file
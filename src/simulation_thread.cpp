@@ -0,0 +1,132 @@
+#include "simulation_thread.hpp"
+
+SimulationThread::SimulationThread(Simulation& sim, std::size_t queue_size) :
+    sim(sim),
+    commands(queue_size),
+    buffers{},
+    back(2),
+    front(0),
+    middle(1),
+    sequence(0),
+    consumed(0),
+    paced(true),
+    publish_tree(false),
+    running(false) {}
+
+SimulationThread::~SimulationThread() {
+    Stop();
+}
+
+void SimulationThread::Publish() {
+
+    Snapshot& snapshot = buffers[back];
+    snapshot.sequence = ++sequence;
+    snapshot.particles = sim.GetParticles(); // reuses the buffer's capacity once it has grown
+    snapshot.stats = sim.GetStats();
+
+    // built over the copy, so it stays valid for as long as the snapshot is drawn
+    snapshot.has_tree = publish_tree.load(std::memory_order_acquire);
+    if (snapshot.has_tree) {
+        snapshot.tree.Build(BoundingSquare(snapshot.particles), snapshot.particles);
+    }
+    else {
+        snapshot.tree.Clear();
+    }
+
+    snapshot.solver = sim.GetSolver();
+    snapshot.theta = sim.GetTheta();
+    snapshot.integrator = sim.GetIntegrator();
+    snapshot.dt = sim.GetDt();
+    snapshot.block_levels = sim.GetBlockLevels();
+    snapshot.periodic = sim.IsPeriodic();
+    snapshot.fmm_order = sim.GetFastMultipole().GetOrder();
+    snapshot.fmm_depth = sim.GetFastMultipole().GetDepth();
+    snapshot.grid_size = sim.GetParticleMesh().GetGridSize();
+
+    DirectSum& direct_sum = sim.GetDirectSum();
+    snapshot.simd_level = direct_sum.GetSimdLevel();
+    snapshot.deterministic = direct_sum.IsDeterministic();
+    snapshot.balanced = direct_sum.IsBalanced();
+    snapshot.imbalance = direct_sum.GetImbalance();
+    snapshot.thread_times = direct_sum.GetThreadTimes();
+
+    // the filled buffer becomes the middle one, the old middle one is written next
+    back = middle.exchange(back | fresh_bit, std::memory_order_acq_rel) & ~fresh_bit;
+}
+
+void SimulationThread::Loop() {
+
+    while (running.load(std::memory_order_acquire)) {
+        SimulationCommand command;
+        while (commands.Pop(command)) {
+            command(sim);
+        }
+
+        sim.Step();
+        Publish();
+
+        // paced: wait for the renderer to pick the snapshot up
+        long long seen = consumed.load(std::memory_order_acquire);
+        while (seen < sequence && paced.load(std::memory_order_acquire) && running.load(std::memory_order_acquire)) {
+            consumed.wait(seen, std::memory_order_acquire);
+            seen = consumed.load(std::memory_order_acquire);
+        }
+    }
+}
+
+void SimulationThread::Start() {
+
+    if (running.load()) {
+        return;
+    }
+
+    Publish();
+    running.store(true, std::memory_order_release);
+    thread = std::thread(&SimulationThread::Loop, this);
+}
+
+void SimulationThread::Stop() {
+
+    if (!running.load()) {
+        return;
+    }
+
+    // changing consumed wakes a paced wait
+    running.store(false, std::memory_order_release);
+    consumed.fetch_add(1, std::memory_order_acq_rel);
+    consumed.notify_all();
+    thread.join();
+}
+
+bool SimulationThread::Post(SimulationCommand command) {
+    return commands.Push(std::move(command));
+}
+
+const Snapshot& SimulationThread::Acquire() {
+
+    if (middle.load(std::memory_order_acquire) & fresh_bit) {
+        front = middle.exchange(front, std::memory_order_acq_rel) & ~fresh_bit;
+        consumed.store(buffers[front].sequence, std::memory_order_release);
+        consumed.notify_one();
+    }
+
+    return buffers[front];
+}
+
+void SimulationThread::SetPaced(bool paced) {
+    this->paced.store(paced, std::memory_order_release);
+    consumed.fetch_add(1, std::memory_order_acq_rel);
+    consumed.notify_all();
+}
+
+bool SimulationThread::IsPaced() const {
+    return paced.load(std::memory_order_acquire);
+}
+
+void SimulationThread::SetPublishTree(bool publish_tree) {
+    this->publish_tree.store(publish_tree, std::memory_order_release);
+}
+
+bool SimulationThread::IsPublishTree() const {
+    return publish_tree.load(std::memory_order_acquire);
+}
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int num_threads) :
+    num_threads(std::max(1, num_threads)),
+    task(nullptr),
+    generation(0),
+    remaining(0),
+    stopping(false),
+    sync(std::max(1, num_threads)) {
+
+    for (int i = 1; i < this->num_threads; i++) {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cv.notify_all();
+
+    for (std::thread& t : workers) {
+        t.join();
+    }
+}
+
+void ThreadPool::WorkerLoop(int thread_id) {
+
+    long long seen_generation = 0;
+
+    while (true) {
+        const std::function<void(int, int)>* current_task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [&] { return stopping || generation != seen_generation; });
+            if (stopping) {
+                return;
+            }
+            seen_generation = generation;
+            current_task = task;
+        }
+
+        (*current_task)(thread_id, num_threads);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            remaining--;
+        }
+        done_cv.notify_one();
+    }
+}
+
+void ThreadPool::Run(const std::function<void(int, int)>& task) {
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->task = &task;
+        remaining = num_threads - 1;
+        generation++;
+    }
+    start_cv.notify_all();
+
+    // the calling thread does its share instead of idling
+    task(0, num_threads);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return remaining == 0; });
+}
+
+void ThreadPool::ParallelFor(int begin, int end, const std::function<void(int, int)>& task) {
+
+    long long count = end - begin;
+    Run([&](int thread_id, int num_threads) {
+        int start = begin + static_cast<int>(count * thread_id / num_threads);
+        int stop = begin + static_cast<int>(count * (thread_id + 1) / num_threads);
+        if (start < stop) {
+            task(start, stop);
+        }
+    });
+}
+
+void ThreadPool::Sync() {
+    sync.arrive_and_wait();
+}
+
+int ThreadPool::GetNumThreads() const {
+    return num_threads;
+}